@@ -5,11 +5,50 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <deque>
 #include <string>
+#include <string_view>
 #include <ctime>
 #include <chrono>
 #include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
+#include <charconv>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <shared_mutex>
+#include <array>
+#include <functional>
+#include <optional>
+#include <map>
+#include <cctype>
+#include <limits>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <cmath>
+#include <numeric>
+#include <random>
+#include <initializer_list>
+#include <list>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LIBRARY_HAVE_POSIX 1
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 
 long long currentDaysSinceEpoch() {
     using namespace std::chrono;
@@ -23,6 +62,104 @@ long long daysDifferenceFromNow(long long dayStamp) {
     return currentDaysSinceEpoch() - dayStamp;
 }
 
+// --------------------------------------------------
+// Read-only view of a whole data file. On POSIX the file is mmap'ed so the
+// loaders slice records straight out of the page cache; elsewhere it is
+// pulled in with a single read.
+// --------------------------------------------------
+class MappedFile {
+private:
+    const char* data;
+    std::size_t size;
+    bool mapped;
+    bool opened;
+    std::string buffer; // fallback storage when mmap isn't used
+public:
+    explicit MappedFile(const std::string &filename)
+        : data(nullptr), size(0), mapped(false), opened(false) {
+#ifdef LIBRARY_HAVE_POSIX
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd < 0) return;
+        opened = true;
+        struct stat st;
+        off_t fileSize = (::fstat(fd, &st) == 0) ? st.st_size : -1;
+        if(fileSize > 0) {
+            void* p = ::mmap(nullptr, (std::size_t) fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p != MAP_FAILED) {
+                ::madvise(p, (std::size_t) fileSize, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(p);
+                size = (std::size_t) fileSize;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if(mapped || fileSize == 0) return;
+#endif
+        std::ifstream fin(filename, std::ios::binary);
+        if(!fin.is_open()) return;
+        opened = true;
+        buffer.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+        data = buffer.data();
+        size = buffer.size();
+    }
+    ~MappedFile() {
+#ifdef LIBRARY_HAVE_POSIX
+        if(mapped) ::munmap(const_cast<char*>(data), size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool is_open() const { return opened; }
+    std::string_view view() const { return std::string_view(data, size); }
+
+    // Gives the pages read so far back to the OS and expects random reads
+    // from now on; touching them again reads them from the file
+    void dropPages() {
+#ifdef LIBRARY_HAVE_POSIX
+        if(!mapped) return;
+        ::madvise(const_cast<char*>(data), size, MADV_DONTNEED);
+        ::madvise(const_cast<char*>(data), size, MADV_RANDOM);
+#endif
+    }
+};
+
+// Pops the next line off `rest` (without the newline or a trailing '\r').
+bool nextLine(std::string_view &rest, std::string_view &line) {
+    if(rest.empty()) return false;
+    std::size_t nl = rest.find('\n');
+    if(nl == std::string_view::npos) {
+        line = rest;
+        rest = std::string_view();
+    } else {
+        line = rest.substr(0, nl);
+        rest.remove_prefix(nl + 1);
+    }
+    if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    return true;
+}
+
+// Splits a comma (or `sep`) separated line into at most n fields; returns how many were found.
+std::size_t splitFields(std::string_view line, std::string_view* out, std::size_t n, char sep = ',') {
+    std::size_t count = 0;
+    while(count < n) {
+        std::size_t comma = line.find(sep);
+        out[count++] = line.substr(0, comma);
+        if(comma == std::string_view::npos) break;
+        line.remove_prefix(comma + 1);
+    }
+    return count;
+}
+
+// The data files are comma separated, one record per line, without quoting
+bool isStorableField(std::string_view f) { return f.find_first_of(",\r\n") == std::string_view::npos; }
+
+template <typename T>
+bool parseNumber(std::string_view s, T &out) {
+    auto res = std::from_chars(s.data(), s.data() + s.size(), out);
+    return res.ec == std::errc() && res.ptr == s.data() + s.size();
+}
+
 // --------------------------------------------------
 // enum for simpler and clearer approach for assigning status
 // --------------------------------------------------
@@ -36,10 +173,525 @@ std::string bookStatusToString(BookStatus st) {
     return "Available"; // default
 }
 
-BookStatus stringToBookStatus(const std::string &s) {
+BookStatus stringToBookStatus(std::string_view s) {
     return (s == "Borrowed") ? BookStatus::BORROWED : BookStatus::AVAILABLE;
 }
 
+// A reservation lapses if the book hasn't come back for it within this
+// many days of it being placed
+const long long kReservationExpiryDays = 30;
+
+bool reservationExpired(long long placedDay, long long today) {
+    return placedDay + kReservationExpiryDays < today;
+}
+
+// --------------------------------------------------
+// Roles and their lending rules. A user stores a one-byte Role and every
+// rule check is a load from the active PolicyTable, so adding a patron class
+// means adding an enum value and a table row, not another string comparison.
+// The table starts as kDefaultPolicies and can be replaced at runtime from a
+// policy file (see compilePolicy).
+// --------------------------------------------------
+enum class Role : unsigned char { STUDENT, FACULTY, LIBRARIAN, COUNT };
+
+// One step of a fine schedule: `perDay` for every late day from `fromDay`
+// on, `before` = what the days before it cost (filled in by compilePolicy)
+struct FineTier {
+    int fromDay;
+    double perDay;
+    double before;
+};
+
+struct RolePolicy {
+    static const int kMaxFineTiers = 4;
+
+    const char* name;          // as stored in users.txt
+    bool canBorrow;            // patron menu, borrow/reserve/return
+    int maxBooks;              // loans + active reservations
+    int maxDays;               // loan period
+    bool finesBlockBorrowing;  // unpaid fines stop new loans
+    int blockAfterOverdueDays; // a loan this far past due stops new loans; 0 = never
+    double fineCap;            // most one late return can cost; 0 = no cap
+    int fineTiers;             // 0 = late returns cost nothing
+    FineTier tiers[kMaxFineTiers];
+
+    bool chargesFines() const { return fineTiers > 0; }
+
+    double fineFor(long long overdueDays) const {
+        double fine = 0.0;
+        for(int k = fineTiers - 1; k >= 0; --k) {
+            if(overdueDays < tiers[k].fromDay) continue;
+            fine = tiers[k].before + (double) (overdueDays - tiers[k].fromDay + 1) * tiers[k].perDay;
+            break;
+        }
+        return (fineCap > 0.0 && fine > fineCap) ? fineCap : fine;
+    }
+};
+
+struct PolicyTable {
+    RolePolicy roles[(int) Role::COUNT];
+};
+
+constexpr PolicyTable kDefaultPolicies = {{
+    // name        borrow books days  fines block  overdue block  cap  fine schedule
+    {"Student",    true,  3,    15,   true,        0,             0.0, 1, {{1, 10.0, 0.0}}},
+    {"Faculty",    true,  5,    30,   false,       60,            0.0, 0, {}},
+    {"Librarian",  false, 0,    0,    false,       0,             0.0, 0, {}},
+}};
+
+// Readers load this once per operation; a reload publishes a new table and
+// leaves the old one in place for anyone still using it.
+std::atomic<const PolicyTable*> activePolicies{&kDefaultPolicies};
+
+inline const RolePolicy& rolePolicy(Role r) {
+    return activePolicies.load(std::memory_order_acquire)->roles[(int) r];
+}
+inline std::string_view roleName(Role r) { return kDefaultPolicies.roles[(int) r].name; }
+
+std::optional<Role> parseRole(std::string_view s) {
+    for(int r = 0; r < (int) Role::COUNT; ++r) {
+        if(s == kDefaultPolicies.roles[r].name) return (Role) r;
+    }
+    return std::nullopt;
+}
+
+// Parses a fine schedule: "rate" or steps "rate@fromDay" separated by ';'
+// (e.g. "5;10@8;20@31"), empty for no fines
+bool parseFineSchedule(std::string_view s, RolePolicy &p) {
+    p.fineTiers = 0;
+    while(!s.empty()) {
+        std::size_t semi = s.find(';');
+        std::string_view step = s.substr(0, semi);
+        s = (semi == std::string_view::npos) ? std::string_view() : s.substr(semi + 1);
+        if(p.fineTiers == RolePolicy::kMaxFineTiers) return false;
+        FineTier t{1, 0.0, 0.0};
+        std::size_t at = step.find('@');
+        if(!parseNumber(step.substr(0, at), t.perDay) || t.perDay < 0.0) return false;
+        if(at != std::string_view::npos && !parseNumber(step.substr(at + 1), t.fromDay)) return false;
+        if(p.fineTiers == 0 ? t.fromDay < 1 : t.fromDay <= p.tiers[p.fineTiers - 1].fromDay) return false;
+        if(p.fineTiers > 0) {
+            const FineTier &prev = p.tiers[p.fineTiers - 1];
+            t.before = prev.before + (double) (t.fromDay - prev.fromDay) * prev.perDay;
+        }
+        p.tiers[p.fineTiers++] = t;
+    }
+    return true;
+}
+
+// Compiles a policy file into `out`. One line per role:
+//   role,maxBooks,maxDays,fineSchedule,fineCap,finesBlock,blockAfterOverdueDays
+// '#' starts a comment line; roles not listed keep their built-in rules.
+// On error `out` is left alone and `error` says which line is wrong.
+bool compilePolicy(const std::string &filename, PolicyTable &out, std::string &error) {
+    MappedFile file(filename);
+    if(!file.is_open()) {
+        error = "could not open " + filename;
+        return false;
+    }
+    PolicyTable table = kDefaultPolicies;
+    std::string_view rest = file.view(), line;
+    for(int lineNo = 1; nextLine(rest, line); ++lineNo) {
+        if(line.empty() || line[0] == '#') continue;
+        std::string_view f[7];
+        std::optional<Role> role;
+        int finesBlock = 0;
+        RolePolicy p{};
+        bool ok = splitFields(line, f, 7) == 7 && (role = parseRole(f[0]));
+        if(ok) p = table.roles[(int) *role];
+        ok = ok && p.canBorrow &&
+             parseNumber(f[1], p.maxBooks) && p.maxBooks >= 0 &&
+             parseNumber(f[2], p.maxDays) && p.maxDays > 0 &&
+             parseFineSchedule(f[3], p) &&
+             parseNumber(f[4], p.fineCap) && p.fineCap >= 0.0 &&
+             parseNumber(f[5], finesBlock) && (finesBlock == 0 || finesBlock == 1) &&
+             parseNumber(f[6], p.blockAfterOverdueDays) && p.blockAfterOverdueDays >= 0;
+        if(!ok) {
+            error = filename + ":" + std::to_string(lineNo) + ": bad rule '" + std::string(line) + "'";
+            return false;
+        }
+        p.finesBlockBorrowing = (finesBlock == 1);
+        table.roles[(int) *role] = p;
+    }
+    out = table;
+    return true;
+}
+
+// Compiles `filename` and makes it the active policy. Operations already
+// running finish under the table they started with, and thresholds already
+// scheduled for open loans keep the values they were scheduled with.
+bool reloadLendingPolicy(const std::string &filename, std::string &error) {
+    static std::mutex installMutex;
+    static std::vector<std::unique_ptr<PolicyTable>> installed; // never freed while running
+    std::unique_ptr<PolicyTable> table(new PolicyTable());
+    if(!compilePolicy(filename, *table, error)) return false;
+    std::lock_guard<std::mutex> lock(installMutex);
+    activePolicies.store(table.get(), std::memory_order_release);
+    installed.push_back(std::move(table));
+    return true;
+}
+
+// --------------------------------------------------
+// Credentials. The password field of users.txt holds an scrypt hash:
+//   $scrypt$<log2 N>$<r>$<p>$<salt hex>$<hash hex>
+// Anything else there is a plaintext password from before hashing; it is
+// still accepted, and replaced by a hash on the first successful login.
+// --------------------------------------------------
+
+// SHA-256 (FIPS 180-4), for HMAC/PBKDF2 inside scrypt
+class Sha256 {
+private:
+    std::uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                          0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block[64];
+    std::size_t used = 0;
+    std::uint64_t total = 0;
+
+    static std::uint32_t rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress(const unsigned char* p) {
+        static const std::uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        std::uint32_t w[64];
+        for(int t = 0; t < 16; ++t) {
+            w[t] = (std::uint32_t) p[4 * t] << 24 | (std::uint32_t) p[4 * t + 1] << 16 |
+                   (std::uint32_t) p[4 * t + 2] << 8 | p[4 * t + 3];
+        }
+        for(int t = 16; t < 64; ++t) {
+            std::uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            std::uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for(int t = 0; t < 64; ++t) {
+            std::uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[t] + w[t];
+            std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+public:
+    static const std::size_t kSize = 32;
+
+    void update(const void* data, std::size_t n) {
+        const unsigned char* p = (const unsigned char*) data;
+        total += n;
+        while(n > 0) {
+            std::size_t take = std::min(n, sizeof(block) - used);
+            std::memcpy(block + used, p, take);
+            used += take;
+            p += take;
+            n -= take;
+            if(used == sizeof(block)) {
+                compress(block);
+                used = 0;
+            }
+        }
+    }
+
+    void final(unsigned char out[kSize]) {
+        std::uint64_t bits = total * 8;
+        unsigned char pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while(used != 56) update(&pad, 1);
+        unsigned char len[8];
+        for(int k = 0; k < 8; ++k) len[k] = (unsigned char) (bits >> (56 - 8 * k));
+        update(len, 8);
+        for(int k = 0; k < 8; ++k) {
+            for(int j = 0; j < 4; ++j) out[4 * k + j] = (unsigned char) (h[k] >> (24 - 8 * j));
+        }
+    }
+};
+
+// HMAC-SHA256 over the concatenation of `parts`
+void hmacSha256(std::string_view key, std::initializer_list<std::string_view> parts,
+                unsigned char out[Sha256::kSize]) {
+    unsigned char k[64] = {0}, pad[64];
+    if(key.size() > sizeof(k)) {
+        Sha256 kh;
+        kh.update(key.data(), key.size());
+        kh.final(k);
+    } else {
+        std::memcpy(k, key.data(), key.size());
+    }
+    Sha256 inner, outer;
+    for(int j = 0; j < 64; ++j) pad[j] = k[j] ^ 0x36;
+    inner.update(pad, sizeof(pad));
+    for(std::string_view part : parts) inner.update(part.data(), part.size());
+    inner.final(out);
+    for(int j = 0; j < 64; ++j) pad[j] = k[j] ^ 0x5c;
+    outer.update(pad, sizeof(pad));
+    outer.update(out, Sha256::kSize);
+    outer.final(out);
+}
+
+// PBKDF2-HMAC-SHA256 with one iteration, the only count scrypt uses
+void pbkdf2Sha256(std::string_view pwd, std::string_view salt, unsigned char* out, std::size_t n) {
+    unsigned char t[Sha256::kSize];
+    for(std::uint32_t i = 1; n > 0; ++i) {
+        const char counter[4] = {(char) (i >> 24), (char) (i >> 16), (char) (i >> 8), (char) i};
+        hmacSha256(pwd, {salt, std::string_view(counter, 4)}, t);
+        std::size_t take = std::min(n, sizeof(t));
+        std::memcpy(out, t, take);
+        out += take;
+        n -= take;
+    }
+}
+
+// scrypt (RFC 7914): PBKDF2 around a ROMix that needs 128 * r * 2^logN
+// bytes of memory, so guessing passwords in bulk is expensive in memory
+// as well as time
+class Scrypt {
+private:
+    static std::uint32_t rotl(std::uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+    static void salsa208(std::uint32_t b[16]) {
+        std::uint32_t x[16];
+        std::memcpy(x, b, sizeof(x));
+        for(int round = 0; round < 8; round += 2) {
+            x[ 4] ^= rotl(x[ 0] + x[12],  7); x[ 8] ^= rotl(x[ 4] + x[ 0],  9);
+            x[12] ^= rotl(x[ 8] + x[ 4], 13); x[ 0] ^= rotl(x[12] + x[ 8], 18);
+            x[ 9] ^= rotl(x[ 5] + x[ 1],  7); x[13] ^= rotl(x[ 9] + x[ 5],  9);
+            x[ 1] ^= rotl(x[13] + x[ 9], 13); x[ 5] ^= rotl(x[ 1] + x[13], 18);
+            x[14] ^= rotl(x[10] + x[ 6],  7); x[ 2] ^= rotl(x[14] + x[10],  9);
+            x[ 6] ^= rotl(x[ 2] + x[14], 13); x[10] ^= rotl(x[ 6] + x[ 2], 18);
+            x[ 3] ^= rotl(x[15] + x[11],  7); x[ 7] ^= rotl(x[ 3] + x[15],  9);
+            x[11] ^= rotl(x[ 7] + x[ 3], 13); x[15] ^= rotl(x[11] + x[ 7], 18);
+            x[ 1] ^= rotl(x[ 0] + x[ 3],  7); x[ 2] ^= rotl(x[ 1] + x[ 0],  9);
+            x[ 3] ^= rotl(x[ 2] + x[ 1], 13); x[ 0] ^= rotl(x[ 3] + x[ 2], 18);
+            x[ 6] ^= rotl(x[ 5] + x[ 4],  7); x[ 7] ^= rotl(x[ 6] + x[ 5],  9);
+            x[ 4] ^= rotl(x[ 7] + x[ 6], 13); x[ 5] ^= rotl(x[ 4] + x[ 7], 18);
+            x[11] ^= rotl(x[10] + x[ 9],  7); x[ 8] ^= rotl(x[11] + x[10],  9);
+            x[ 9] ^= rotl(x[ 8] + x[11], 13); x[10] ^= rotl(x[ 9] + x[ 8], 18);
+            x[12] ^= rotl(x[15] + x[14],  7); x[13] ^= rotl(x[12] + x[15],  9);
+            x[14] ^= rotl(x[13] + x[12], 13); x[15] ^= rotl(x[14] + x[13], 18);
+        }
+        for(int k = 0; k < 16; ++k) b[k] += x[k];
+    }
+
+    // in and out are 2r blocks of 16 words
+    static void blockMix(const std::uint32_t* in, std::uint32_t* out, int r) {
+        std::uint32_t x[16];
+        std::memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+        for(int k = 0; k < 2 * r; ++k) {
+            for(int j = 0; j < 16; ++j) x[j] ^= in[k * 16 + j];
+            salsa208(x);
+            // even blocks go to the first half, odd ones to the second
+            std::memcpy(out + ((k / 2) + (k % 2) * r) * 16, x, sizeof(x));
+        }
+    }
+
+    static void roMix(std::uint32_t* x, int r, std::uint64_t n, std::vector<std::uint32_t> &v) {
+        std::size_t words = 32 * (std::size_t) r;
+        std::vector<std::uint32_t> y(words);
+        for(std::uint64_t i = 0; i < n; ++i) {
+            std::memcpy(&v[i * words], x, words * 4);
+            blockMix(x, y.data(), r);
+            std::memcpy(x, y.data(), words * 4);
+        }
+        for(std::uint64_t i = 0; i < n; ++i) {
+            std::uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+            for(std::size_t w = 0; w < words; ++w) x[w] ^= v[j * words + w];
+            blockMix(x, y.data(), r);
+            std::memcpy(x, y.data(), words * 4);
+        }
+    }
+public:
+    static void derive(std::string_view pwd, std::string_view salt, int logN, int r, int p,
+                       unsigned char* out, std::size_t n) {
+        std::size_t blockBytes = 128 * (std::size_t) r;
+        std::vector<unsigned char> b(blockBytes * p);
+        pbkdf2Sha256(pwd, salt, b.data(), b.size());
+        std::vector<std::uint32_t> x(32 * (std::size_t) r), v(x.size() << logN);
+        for(int k = 0; k < p; ++k) {
+            unsigned char* chunk = b.data() + k * blockBytes;
+            for(std::size_t w = 0; w < x.size(); ++w) {   // little-endian words
+                x[w] = (std::uint32_t) chunk[4 * w] | (std::uint32_t) chunk[4 * w + 1] << 8 |
+                       (std::uint32_t) chunk[4 * w + 2] << 16 | (std::uint32_t) chunk[4 * w + 3] << 24;
+            }
+            roMix(x.data(), r, (std::uint64_t) 1 << logN, v);
+            for(std::size_t w = 0; w < x.size(); ++w) {
+                for(int j = 0; j < 4; ++j) chunk[4 * w + j] = (unsigned char) (x[w] >> (8 * j));
+            }
+        }
+        pbkdf2Sha256(pwd, std::string_view((const char*) b.data(), b.size()), out, n);
+    }
+};
+
+// Compares in time that depends only on n, not on where the inputs differ
+bool constantTimeEquals(const unsigned char* a, const unsigned char* b, std::size_t n) {
+    unsigned char diff = 0;
+    for(std::size_t k = 0; k < n; ++k) diff |= a[k] ^ b[k];
+    return diff == 0;
+}
+
+std::string toHex(const unsigned char* p, std::size_t n) {
+    static const char digits[] = "0123456789abcdef";
+    std::string s;
+    for(std::size_t k = 0; k < n; ++k) {
+        s += digits[p[k] >> 4];
+        s += digits[p[k] & 15];
+    }
+    return s;
+}
+
+bool fromHex(std::string_view s, std::string &out) {
+    if(s.size() % 2) return false;
+    out.clear();
+    for(std::size_t k = 0; k < s.size(); k += 2) {
+        unsigned v;
+        auto res = std::from_chars(s.data() + k, s.data() + k + 2, v, 16);
+        if(res.ec != std::errc() || res.ptr != s.data() + k + 2) return false;
+        out += (char) v;
+    }
+    return true;
+}
+
+// Cost of new hashes: 2^14 * 8 * 128 bytes = 16 MB and tens of
+// milliseconds per hash. Stored hashes carry their own parameters.
+const int kScryptLogN = 14, kScryptR = 8, kScryptP = 1;
+const std::size_t kSaltBytes = 16;
+
+bool isPasswordHash(std::string_view stored) { return stored.substr(0, 8) == "$scrypt$"; }
+
+std::string hashPassword(std::string_view pwd) {
+    std::random_device rd;
+    unsigned char salt[kSaltBytes], hash[Sha256::kSize];
+    for(auto &c : salt) c = (unsigned char) rd();
+    Scrypt::derive(pwd, std::string_view((const char*) salt, sizeof(salt)),
+                   kScryptLogN, kScryptR, kScryptP, hash, sizeof(hash));
+    return "$scrypt$" + std::to_string(kScryptLogN) + "$" + std::to_string(kScryptR) + "$" +
+           std::to_string(kScryptP) + "$" + toHex(salt, sizeof(salt)) + "$" + toHex(hash, sizeof(hash));
+}
+
+// Checks `pwd` against a stored hash (or legacy plaintext)
+bool verifyPassword(std::string_view stored, std::string_view pwd) {
+    unsigned char want[Sha256::kSize], got[Sha256::kSize];
+    if(!isPasswordHash(stored)) {
+        // digest both so the comparison doesn't depend on the lengths
+        hmacSha256("", {stored}, want);
+        hmacSha256("", {pwd}, got);
+        return constantTimeEquals(want, got, sizeof(want));
+    }
+    std::string_view f[7];
+    int logN, r, p;
+    std::string salt, hash;
+    std::size_t n = 0;
+    for(std::string_view rest = stored.substr(1); n < 7; ++n) {
+        std::size_t d = rest.find('$');
+        f[n] = rest.substr(0, d);
+        if(d == std::string_view::npos) break;
+        rest.remove_prefix(d + 1);
+    }
+    if(n != 5 || !parseNumber(f[1], logN) || !parseNumber(f[2], r) || !parseNumber(f[3], p) ||
+       logN < 1 || logN > 24 || r < 1 || r > 64 || p < 1 || p > 16 ||
+       !fromHex(f[4], salt) || !fromHex(f[5], hash) || hash.size() != Sha256::kSize) return false;
+    Scrypt::derive(pwd, salt, logN, r, p, got, sizeof(got));
+    return constantTimeEquals(got, (const unsigned char*) hash.data(), sizeof(got));
+}
+
+// Costs what verifying a real hash costs and never matches. Failed logins
+// that didn't run the KDF (unknown userID, legacy plaintext entry) call it,
+// so the response time doesn't tell which userIDs exist.
+void burnPasswordCheck(std::string_view pwd) {
+    static const std::string dummy = "$scrypt$" + std::to_string(kScryptLogN) + "$" +
+        std::to_string(kScryptR) + "$" + std::to_string(kScryptP) + "$" +
+        std::string(2 * kSaltBytes, '0') + "$" + std::string(2 * Sha256::kSize, '0');
+    verifyPassword(dummy, pwd);
+}
+
+// Remembers the last verified login per userID as a keyed digest of
+// (userID, stored hash, password) under a per-process secret, so a repeat
+// login costs one HMAC instead of a KDF run. No password is kept, and a
+// changed hash simply stops matching.
+class CredentialCache {
+private:
+    static const std::size_t kShards = 16;
+    static const std::size_t kPerShard = 4096; // a full shard starts over
+    using Tag = std::array<unsigned char, Sha256::kSize>;
+    struct Shard {
+        std::mutex m;
+        std::unordered_map<std::string, Tag> tags;
+    };
+    std::string secret;
+    Shard shards[kShards];
+
+    Shard& shardFor(std::string_view uid) { return shards[std::hash<std::string_view>()(uid) % kShards]; }
+
+    Tag tagFor(std::string_view uid, std::string_view stored, std::string_view pwd) const {
+        Tag t;
+        const char sep = 0;
+        hmacSha256(secret, {uid, std::string_view(&sep, 1), stored, std::string_view(&sep, 1), pwd}, t.data());
+        return t;
+    }
+public:
+    CredentialCache() {
+        std::random_device rd;
+        for(int k = 0; k < 32; ++k) secret += (char) rd();
+    }
+
+    bool contains(std::string_view uid, std::string_view stored, std::string_view pwd) {
+        Tag t = tagFor(uid, stored, pwd);
+        Shard &s = shardFor(uid);
+        std::lock_guard<std::mutex> lock(s.m);
+        auto it = s.tags.find(std::string(uid));
+        return it != s.tags.end() && constantTimeEquals(it->second.data(), t.data(), t.size());
+    }
+
+    void insert(std::string_view uid, std::string_view stored, std::string_view pwd) {
+        Tag t = tagFor(uid, stored, pwd);
+        Shard &s = shardFor(uid);
+        std::lock_guard<std::mutex> lock(s.m);
+        if(s.tags.size() >= kPerShard) s.tags.clear();
+        s.tags[std::string(uid)] = t;
+    }
+};
+
+// Failed logins per userID, as token buckets of kBurst attempts refilled
+// one every kRefillMs. Each bucket is one atomic "theoretical arrival time"
+// (GCRA), so checking and charging are a load and a CAS with no lock.
+// UserIDs hash into a fixed set of buckets; a collision only makes two
+// users share a limit.
+class LoginThrottle {
+private:
+    static const std::size_t kBuckets = 4096;
+    static const std::int64_t kBurst = 5;
+    static const std::int64_t kRefillMs = 2000;
+    std::atomic<std::int64_t> tat[kBuckets] = {};
+
+    static std::int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+    std::atomic<std::int64_t>& bucket(std::string_view uid) {
+        return tat[std::hash<std::string_view>()(uid) % kBuckets];
+    }
+public:
+    // Takes a token; false if uid has used up its attempts for now
+    bool tryAcquire(std::string_view uid) {
+        std::atomic<std::int64_t> &b = bucket(uid);
+        std::int64_t now = nowMs();
+        std::int64_t t = b.load(std::memory_order_relaxed);
+        while(true) {
+            std::int64_t next = std::max(t, now) + kRefillMs;
+            if(next - now > kBurst * kRefillMs) return false;
+            if(b.compare_exchange_weak(t, next, std::memory_order_relaxed)) return true;
+        }
+    }
+
+    // A successful login clears its failures
+    void reset(std::string_view uid) { bucket(uid).store(0, std::memory_order_relaxed); }
+};
+
 class Account; // defined later
 
 // User class, which is inherited by Student, Faculty and Librarian child classes
@@ -48,113 +700,295 @@ protected:
     std::string userID;
     std::string password;
     std::string name;
-    std::string role;  // "Student", "Faculty" or "Librarian"
+    Role role;
     double fine;
 public:
     Account* account;
 
-    User(const std::string& u="", const std::string& p="",
-         const std::string& n="", const std::string& r="", double f=0.0)
+    User(const std::string& u, const std::string& p,
+         const std::string& n, Role r, double f=0.0)
         : userID(u), password(p), name(n), role(r), fine(f), account(nullptr) {}
 
     virtual ~User() {}
 
     std::string getUserID()   const { return userID; }
-    std::string getPassword() const { return password; }
+    const std::string& getUserIDRef() const { return userID; }
+    std::string getPassword() const { return password; } // hash, or legacy plaintext
     std::string getName()     const { return name; }
-    std::string getRole()     const { return role; }
+    Role        getRole()     const { return role; }
+    std::string_view getRoleName() const { return roleName(role); }
+    const RolePolicy& policy() const { return rolePolicy(role); }
     double      getFine()     const { return fine; }
 
     void setFine(double f) { fine = f; }
+    void setPassword(const std::string &p) { password = p; }
+    void setName(const std::string &n) { name = n; }
 
-    virtual int  getMaxBooksAllowed() const = 0;
-    virtual int  getMaxBorrowDays()   const = 0;
-    virtual bool hasFines()           const { return (fine > 0); }
+    int  getMaxBooksAllowed() const { return policy().maxBooks; }
+    int  getMaxBorrowDays()   const { return policy().maxDays; }
+    bool hasFines()           const { return policy().chargesFines() && fine > 0; }
 
     virtual void borrowBook(const std::string& ISBN) = 0;
     virtual void returnBook(const std::string& ISBN) = 0;
 
-    void payFine() {
-        std::cout << "Your outstanding fine is: " << fine << "\n";
-        std::cout << "Enter amount to pay: ";
-        double amt;
-        std::cin >> amt;
+    // Returns true once the fine is fully paid
+    bool applyPayment(double amt) {
         if(amt >= fine) {
-            std::cout << "Fine cleared!\n";
             fine = 0.0;
-        } else {
-            fine -= amt;
-            std::cout << "Partial payment done. Remaining fine: " << fine << "\n";
+            return true;
         }
+        fine -= amt;
+        return false;
     }
 };
 
+// Overdue stages a loan has reached (set by the due-date sweep)
+enum : unsigned char { LOAN_OVERDUE = 1, LOAN_BLOCKING = 2 };
+
 struct BorrowInfo {
     std::string ISBN;
     long long borrowDay;
+    unsigned char stages = 0; // LOAN_* flags
+};
+
+// One finished borrow. bookId is the book's catalog slot (slots are never
+// reused, so it keeps naming the book after it's removed).
+struct HistoryEntry {
+    std::uint32_t bookId;
+    std::int32_t borrowDay;
+    std::int32_t returnDay;
+};
+
+// --------------------------------------------------
+// Scratch file for older history entries. Entries are written in blocks,
+// and each block starts with the offset of the same account's previous
+// block, so an account only remembers its newest block and walks back
+// from there. It's an anonymous temp file that lives as long as the
+// process: the checkpoint still holds the complete history.
+// --------------------------------------------------
+class HistorySpill {
+private:
+    struct BlockHeader {
+        long long prev;        // previous block of the same account, -1 = none
+        std::uint32_t count;   // entries following the header
+        std::uint32_t unused;
+    };
+    std::FILE* file = nullptr;
+    long long end = 0;
+    std::mutex m;
+public:
+    HistorySpill() {}
+    HistorySpill(const HistorySpill&) = delete;
+    HistorySpill& operator=(const HistorySpill&) = delete;
+    ~HistorySpill() { close(); }
+
+    bool open() {
+        std::lock_guard<std::mutex> lock(m);
+        if(file) std::fclose(file);
+        file = std::tmpfile();
+        end = 0;
+        return file != nullptr;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m);
+        if(file) std::fclose(file);
+        file = nullptr;
+    }
+
+    // Appends a block; returns its offset, or -1 if it couldn't be written
+    long long write(long long prev, const HistoryEntry* entries, std::size_t n) {
+        std::lock_guard<std::mutex> lock(m);
+        if(!file) return -1;
+        BlockHeader h{prev, (std::uint32_t) n, 0};
+        if(std::fseek(file, (long) end, SEEK_SET) != 0 ||
+           std::fwrite(&h, sizeof(h), 1, file) != 1 ||
+           std::fwrite(entries, sizeof(HistoryEntry), n, file) != n) return -1;
+        long long at = end;
+        end += (long long) (sizeof(h) + n * sizeof(HistoryEntry));
+        return at;
+    }
+
+    bool read(long long offset, long long &prev, std::vector<HistoryEntry> &out) {
+        std::lock_guard<std::mutex> lock(m);
+        BlockHeader h;
+        if(!file || std::fseek(file, (long) offset, SEEK_SET) != 0 ||
+           std::fread(&h, sizeof(h), 1, file) != 1) return false;
+        out.resize(h.count);
+        if(std::fread(out.data(), sizeof(HistoryEntry), h.count, file) != h.count) return false;
+        prev = h.prev;
+        return true;
+    }
 };
 
 class Account {
 private:
     std::vector<BorrowInfo> currentlyBorrowed;
-    std::vector<std::string> borrowHistory;
-    int reservations;
-public:
-    Account() {reservations = 0;}
+    int overdueLoans = 0;  // loans flagged LOAN_OVERDUE
+    int blockingLoans = 0; // loans flagged LOAN_BLOCKING
+
+    // Most recent history, oldest first. Once it holds 2 * kHistoryWindow
+    // entries the older half goes to the HistorySpill; spilledTail is the
+    // newest block written there.
+    std::vector<HistoryEntry> recentHistory;
+    long long spilledTail = -1;
+    std::size_t spilledCount = 0;
 
-    void addBorrowed(const std::string &isbn) {
-        BorrowInfo bi { isbn, currentDaysSinceEpoch() };
-        currentlyBorrowed.push_back(bi);
+    // ISBN -> position in currentlyBorrowed. Only kept while the list is
+    // longer than kIndexAbove; a short list is faster to just scan.
+    static const std::size_t kIndexAbove = 8;
+    std::unordered_map<std::string, std::size_t> borrowIndex;
+
+    static const std::size_t npos = static_cast<std::size_t>(-1);
+
+    std::size_t borrowPos(std::string_view isbn) const {
+        if(currentlyBorrowed.size() > kIndexAbove) {
+            auto it = borrowIndex.find(std::string(isbn)); // ISBNs fit the small-string buffer
+            return (it == borrowIndex.end()) ? npos : it->second;
+        }
+        for(std::size_t k = 0; k < currentlyBorrowed.size(); ++k) {
+            if(currentlyBorrowed[k].ISBN == isbn) return k;
+        }
+        return npos;
     }
+public:
+    struct ReservedBook {
+        std::string isbn;
+        long long day;
+    };
+private:
+    // Books this user is waiting for (the other half of each book's
+    // ReservationQueue entry), with the day each reservation was placed
+    std::vector<ReservedBook> reserved;
+public:
+    Account() {}
 
-    bool returnBorrowed(const std::string &isbn) {
-        for(auto it = currentlyBorrowed.begin(); it != currentlyBorrowed.end(); ++it) {
-            if(it->ISBN == isbn) {
-                borrowHistory.push_back(isbn);
-                currentlyBorrowed.erase(it);
-                return true;
+    // Borrowing the same ISBN twice keeps the first entry (and returns false)
+    bool addBorrowed(std::string_view isbn, long long day = currentDaysSinceEpoch()) {
+        if(borrowPos(isbn) != npos) return false;
+        currentlyBorrowed.push_back(BorrowInfo{ std::string(isbn), day });
+        if(currentlyBorrowed.size() == kIndexAbove + 1) {
+            for(std::size_t k = 0; k < currentlyBorrowed.size(); ++k) {
+                borrowIndex.emplace(currentlyBorrowed[k].ISBN, k);
             }
+        } else if(currentlyBorrowed.size() > kIndexAbove + 1) {
+            borrowIndex.emplace(currentlyBorrowed.back().ISBN, currentlyBorrowed.size() - 1);
         }
-        return false;
+        return true;
+    }
+
+    // Flags the loan of `isbn` made on `borrowDay` with `stage`; false if
+    // there's no such loan (returned meanwhile) or it already had it
+    bool markLoanStage(std::string_view isbn, long long borrowDay, unsigned char stage) {
+        std::size_t pos = borrowPos(isbn);
+        if(pos == npos) return false;
+        BorrowInfo &bi = currentlyBorrowed[pos];
+        if(bi.borrowDay != borrowDay || (bi.stages & stage)) return false;
+        bi.stages |= stage;
+        if(stage == LOAN_OVERDUE) ++overdueLoans;
+        else ++blockingLoans;
+        return true;
     }
 
-    bool isBorrowing(const std::string &isbn) const {
-        for(const auto &b : currentlyBorrowed) {
-            if(b.ISBN == isbn) return true;
+    int getOverdueLoans() const { return overdueLoans; }
+    bool hasBlockingLoan() const { return blockingLoans > 0; }
+
+    // Ends the borrow of `isbn` with one lookup and returns the day it was
+    // borrowed, or nothing if it wasn't borrowed. The last entry takes the
+    // freed position, so order isn't preserved.
+    std::optional<long long> takeBorrowed(std::string_view isbn) {
+        std::size_t pos = borrowPos(isbn);
+        if(pos == npos) return std::nullopt;
+        bool indexed = currentlyBorrowed.size() > kIndexAbove;
+        BorrowInfo &bi = currentlyBorrowed[pos];
+        long long day = bi.borrowDay;
+        if(bi.stages & LOAN_OVERDUE) --overdueLoans;
+        if(bi.stages & LOAN_BLOCKING) --blockingLoans;
+        if(indexed) borrowIndex.erase(bi.ISBN);
+        if(pos + 1 != currentlyBorrowed.size()) {
+            bi = std::move(currentlyBorrowed.back());
+            if(indexed) borrowIndex[bi.ISBN] = pos;
         }
-        return false;
+        currentlyBorrowed.pop_back();
+        if(currentlyBorrowed.size() == kIndexAbove) borrowIndex.clear();
+        return day;
+    }
+
+    static const std::size_t kHistoryWindow = 64;
+
+    void addHistory(const HistoryEntry &e) { recentHistory.push_back(e); }
+    bool historyOverflowing() const { return recentHistory.size() >= 2 * kHistoryWindow; }
+
+    // The entries to spill next, and dropping them once they are on disk
+    // in the block at `offset`
+    std::size_t spillableCount() const { return recentHistory.size() - kHistoryWindow; }
+    const HistoryEntry* spillable() const { return recentHistory.data(); }
+    void markSpilled(long long offset, std::size_t n) {
+        recentHistory.erase(recentHistory.begin(), recentHistory.begin() + n);
+        spilledTail = offset;
+        spilledCount += n;
+    }
+
+    const std::vector<HistoryEntry>& getRecentHistory() const { return recentHistory; }
+    long long getSpilledTail() const { return spilledTail; }
+    std::size_t historySize() const { return spilledCount + recentHistory.size(); }
+
+    bool isBorrowing(std::string_view isbn) const {
+        return borrowPos(isbn) != npos;
     }
 
     int borrowedCount() const {
         return (int) currentlyBorrowed.size();
     }
 
-    long long getBorrowDay(const std::string &isbn) const {
-        for(const auto &b : currentlyBorrowed) {
-            if(b.ISBN == isbn) return b.borrowDay;
-        }
-        return -1;
+    long long getBorrowDay(std::string_view isbn) const {
+        std::size_t pos = borrowPos(isbn);
+        return (pos == npos) ? -1 : currentlyBorrowed[pos].borrowDay;
     }
 
     const std::vector<BorrowInfo>& getCurrentBorrows() const {
         return currentlyBorrowed;
     }
-    const std::vector<std::string>& getHistory() const {
-        return borrowHistory;
+
+    void addReservation(std::string_view isbn, long long day) {
+        reserved.push_back(ReservedBook{std::string(isbn), day});
+    }
+
+    // Drops the reservation of `isbn` (only the one placed on `day`, if given)
+    bool dropReservation(std::string_view isbn, std::optional<long long> day = std::nullopt) {
+        for(auto it = reserved.begin(); it != reserved.end(); ++it) {
+            if(it->isbn == isbn && (!day || it->day == *day)) {
+                reserved.erase(it);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::optional<long long> reservationDay(std::string_view isbn) const {
+        for(const auto &r : reserved) {
+            if(r.isbn == isbn) return r.day;
+        }
+        return std::nullopt;
     }
 
-    void updateReservations(int r) { reservations = r; }
-    int getReservations() const { return reservations; }
+    // Forgets lapsed reservations (their queue entries are skipped at
+    // hand-off) and returns how many are still waiting
+    int activeReservations(long long today) {
+        reserved.erase(std::remove_if(reserved.begin(), reserved.end(),
+                                      [today](const ReservedBook &r) { return reservationExpired(r.day, today); }),
+                       reserved.end());
+        return (int) reserved.size();
+    }
+
+    const std::vector<ReservedBook>& getReservedBooks() const { return reserved; }
 };
 
 class Student : public User {
 public:
     Student(const std::string &u, const std::string &p,
             const std::string &n, double f=0.0)
-        : User(u,p,n,"Student",f) {}
-
-    int getMaxBooksAllowed() const override { return 3; }
-    int getMaxBorrowDays()   const override { return 15; }
+        : User(u,p,n,Role::STUDENT,f) {}
 
     void borrowBook(const std::string &isbn) override {
         std::cout << "Borrow request by Student: " << name
@@ -171,10 +1005,7 @@ class Faculty : public User {
 public:
     Faculty(const std::string &u, const std::string &p,
             const std::string &n, double f=0.0)
-        : User(u,p,n,"Faculty",f) {}
-
-    int getMaxBooksAllowed() const override { return 5; }
-    int getMaxBorrowDays()   const override { return 30; }
+        : User(u,p,n,Role::FACULTY,f) {}
 
     void borrowBook(const std::string &isbn) override {
         std::cout << "Borrow request by Faculty: " << name
@@ -185,19 +1016,13 @@ public:
         std::cout << "Return request by Faculty: " << name
                   << " for ISBN: " << isbn << "\n";
     }
-
-    // Typically faculty have no monetary fines
-    bool hasFines() const override { return false; }
 };
 
 class Librarian : public User {
 public:
     Librarian(const std::string &u, const std::string &p,
               const std::string &n)
-        : User(u,p,n,"Librarian",0.0) {}
-
-    int getMaxBooksAllowed() const override { return 0; }
-    int getMaxBorrowDays()   const override { return 0; }
+        : User(u,p,n,Role::LIBRARIAN,0.0) {}
 
     void borrowBook(const std::string &isbn) override {
         std::cout << "Librarian cannot borrow books.\n";
@@ -209,565 +1034,4693 @@ public:
 };
 
 
-class Book {
+// --------------------------------------------------
+// Owns every User and its Account. Each patron gets one slot holding both
+// objects, and slots are carved out of blocks of kBlockSlots, so loading a
+// roster costs one allocation per block instead of two per user. Freed
+// slots are reused. Dropping the pool releases whole blocks; the objects'
+// destructors still run since names/borrow lists own heap memory.
+// Not thread-safe: the Library only uses it under the exclusive lock.
+// --------------------------------------------------
+class UserPool {
 private:
-    std::string ISBN;
-    std::string title;
-    std::string author;
-    std::string publisher;
-    int year;
-    BookStatus status;
-    std::string reservedBy;
-public:
-    Book()
-        : year(0), status(BookStatus::AVAILABLE), reservedBy("") {}
-    Book(const std::string &i, const std::string &t, const std::string &a,
-         const std::string &pub, int y, BookStatus st)
-        : ISBN(i), title(t), author(a), publisher(pub), year(y), status(st),
-          reservedBy("") {}
+    static const std::size_t kBlockSlots = 1024;
+    static constexpr std::size_t kUserSize =
+        std::max({sizeof(Student), sizeof(Faculty), sizeof(Librarian)});
+    static constexpr std::size_t kUserAlign =
+        std::max({alignof(Student), alignof(Faculty), alignof(Librarian)});
 
-    const std::string& getISBN()      const { return ISBN; }
-    const std::string& getTitle()     const { return title; }
-    const std::string& getAuthor()    const { return author; }
-    const std::string& getPublisher() const { return publisher; }
-    int  getYear()                    const { return year; }
-    BookStatus getStatus()            const { return status; }
-    std::string getStatusString()     const { return bookStatusToString(status); }
-    const std::string& getReservedBy() const { return reservedBy; }
+    struct Slot {
+        alignas(kUserAlign) unsigned char userStorage[kUserSize];
+        alignas(Account) unsigned char accountStorage[sizeof(Account)];
+        User* user;     // the object in userStorage, as a User*
+        Slot* nextFree; // only meaningful while the slot is free
+        std::uint32_t index;
+        bool live;
+    };
 
-    void setStatus(BookStatus s)           { status = s; }
-    void setReservedBy(const std::string &uid) { reservedBy = uid; }
+    std::vector<std::unique_ptr<Slot[]>> blocks;
+    std::size_t usedInLast = kBlockSlots; // slots handed out from blocks.back()
+    Slot* freeList = nullptr;
 
-    void setISBN(const std::string &i)      { ISBN = i; }
-    void setTitle(const std::string &t)     { title = t; }
-    void setAuthor(const std::string &a)    { author = a; }
-    void setPublisher(const std::string &p) { publisher = p; }
-    void setYear(int y)                     { year = y; }
-};
+    Slot* grab() {
+        if(freeList) {
+            Slot* s = freeList;
+            freeList = s->nextFree;
+            return s;
+        }
+        if(usedInLast == kBlockSlots) {
+            blocks.emplace_back(new Slot[kBlockSlots]);
+            usedInLast = 0;
+        }
+        Slot* s = &blocks.back()[usedInLast];
+        s->index = (std::uint32_t) ((blocks.size() - 1) * kBlockSlots + usedInLast++);
+        return s;
+    }
 
+    // The most-derived object starts at userStorage, the first member of Slot
+    static Slot* slotOf(User* u) { return static_cast<Slot*>(dynamic_cast<void*>(u)); }
 
-class Library {
-private:
-    std::vector<Book> books;
-    std::vector<User*> users;
+    static void destroyIn(Slot &s) {
+        s.user->account->~Account();
+        s.user->~User();
+        s.live = false;
+    }
 
 public:
-    Library() {}
-    ~Library() {
-        // Clean up allocated users
-        for(User* u : users) {
-            delete u->account;
-            delete u;
+    UserPool() {}
+    UserPool(const UserPool&) = delete;
+    UserPool& operator=(const UserPool&) = delete;
+    ~UserPool() { clear(); }
+
+    // Creates a user of the given role (nullptr if the role is unknown)
+    User* make(std::string_view roleName, const std::string &uid, const std::string &pwd,
+               const std::string &nm, double fine = 0.0) {
+        std::optional<Role> role = parseRole(roleName);
+        if(!role) return nullptr;
+        Slot* s = grab();
+        User* uPtr;
+        switch(*role) {
+            case Role::STUDENT: uPtr = new (s->userStorage) Student(uid, pwd, nm, fine); break;
+            case Role::FACULTY: uPtr = new (s->userStorage) Faculty(uid, pwd, nm, fine); break;
+            default:            uPtr = new (s->userStorage) Librarian(uid, pwd, nm); break;
         }
+        uPtr->account = new (s->accountStorage) Account();
+        s->user = uPtr;
+        s->live = true;
+        return uPtr;
     }
 
-    
-    void loadBooks(const std::string &filename) {
-        std::ifstream fin(filename);
-        if(!fin.is_open()) {
-            std::cerr << "Could not open " << filename << "\n";
-            return;
+    // Whether `u` points at a user that hasn't been destroyed. The slot may
+    // have been reused for another user since.
+    static bool isLive(User* u) { return slotOf(u)->live; }
+
+    // Slot numbers are stable for a user's lifetime and run 0..slotCount()-1
+    static std::size_t slotIndex(const User* u) { return slotOf(const_cast<User*>(u))->index; }
+    std::size_t slotCount() const { return blocks.empty() ? 0 : (blocks.size() - 1) * kBlockSlots + usedInLast; }
+
+    // The user in a slot, or nullptr if the slot is free
+    User* userAt(std::size_t slot) const {
+        const Slot &s = blocks[slot / kBlockSlots][slot % kBlockSlots];
+        return s.live ? s.user : nullptr;
+    }
+
+    void destroy(User* u) {
+        Slot* s = slotOf(u);
+        destroyIn(*s);
+        s->nextFree = freeList;
+        freeList = s;
+    }
+
+    void clear() {
+        for(std::size_t b = 0; b < blocks.size(); ++b) {
+            std::size_t n = (b + 1 == blocks.size()) ? usedInLast : kBlockSlots;
+            for(std::size_t k = 0; k < n; ++k) {
+                if(blocks[b][k].live) destroyIn(blocks[b][k]);
+            }
         }
-        books.clear();
-        std::string line;
-        while(std::getline(fin, line)) {
-            if(line.empty()) continue;
-            std::stringstream ss(line);
-            std::string i, t, a, pub, ystr, st;
-            std::getline(ss, i, ',');
-            std::getline(ss, t, ',');
-            std::getline(ss, a, ',');
-            std::getline(ss, pub, ',');
-            std::getline(ss, ystr, ',');
-            std::getline(ss, st, ',');
+        blocks.clear();
+        usedInLast = kBlockSlots;
+        freeList = nullptr;
+    }
+};
+
+// --------------------------------------------------
+// Due-date queue: a min-heap of the next day each open loan crosses a
+// threshold (overdue, then for faculty the 60-days-past-due block). The
+// daily sweep pops only what became due, so checking whether a faculty
+// member is blocked is a counter read instead of a scan of their loans.
+// Entries aren't removed on return; the sweep skips the stale ones.
+// --------------------------------------------------
+struct DueEntry {
+    std::int32_t fireDay;   // first day the loan is past the threshold
+    std::uint32_t bookId;
+    std::int32_t borrowDay;
+    unsigned char stage;    // LOAN_OVERDUE or LOAN_BLOCKING
+    User* user;
+};
+
+class DueQueue {
+private:
+    struct Later {
+        bool operator()(const DueEntry &a, const DueEntry &b) const { return a.fireDay > b.fireDay; }
+    };
+    std::vector<DueEntry> heap;
+    std::mutex m; // held only briefly, never while taking another lock
+public:
+    void push(const DueEntry &e) {
+        std::lock_guard<std::mutex> lock(m);
+        heap.push_back(e);
+        std::push_heap(heap.begin(), heap.end(), Later());
+    }
 
-            int y = std::stoi(ystr);
-            BookStatus bst = stringToBookStatus(st);
-            Book bk(i, t, a, pub, y, bst);
-            bk.setReservedBy(""); // not storing reserved user in file (can be known while reading through the transactions
-            books.push_back(bk);
+    // Moves every entry due on or before `day` into `out`
+    void popDue(long long day, std::vector<DueEntry> &out) {
+        std::lock_guard<std::mutex> lock(m);
+        while(!heap.empty() && heap.front().fireDay <= day) {
+            std::pop_heap(heap.begin(), heap.end(), Later());
+            out.push_back(heap.back());
+            heap.pop_back();
         }
-        fin.close();
     }
 
-    void loadUsers(const std::string &filename) {
-        std::ifstream fin(filename);
-        if(!fin.is_open()) {
-            std::cerr << "Could not open " << filename << "\n";
-            return;
-        }
-        users.clear();
-        std::string line;
-        while(std::getline(fin, line)) {
-            if(line.empty()) continue;
-            std::stringstream ss(line);
-            std::string uid, pwd, nm, rl, fineStr;
-            std::getline(ss, uid, ',');
-            std::getline(ss, pwd, ',');
-            std::getline(ss, nm, ',');
-            std::getline(ss, rl, ',');
-            std::getline(ss, fineStr, ',');
-
-            double f = std::stod(fineStr);
-
-            User* uPtr = nullptr;
-            if(rl == "Student") {
-                uPtr = new Student(uid, pwd, nm, f);
-            } else if(rl == "Faculty") {
-                uPtr = new Faculty(uid, pwd, nm, f);
-            } else if(rl == "Librarian") {
-                uPtr = new Librarian(uid, pwd, nm);
+    void clear() {
+        std::lock_guard<std::mutex> lock(m);
+        heap.clear();
+    }
+};
+
+// Size of a file in bytes, or -1 if it can't be opened
+long long fileSize(const std::string &filename) {
+    std::ifstream fin(filename, std::ios::binary | std::ios::ate);
+    if(!fin.is_open()) return -1;
+    return (long long) fin.tellg();
+}
+
+// FNV-1a over the (up to) 64 bytes just before `offset`. A checkpoint keeps
+// this so it can tell the log it points into wasn't rewritten meanwhile.
+unsigned long long logTailHash(const std::string &filename, long long offset) {
+    unsigned long long h = 1469598103934665603ULL;
+    std::ifstream fin(filename, std::ios::binary);
+    if(!fin.is_open() || offset <= 0) return h;
+    long long from = std::max(0LL, offset - 64);
+    char buf[64];
+    fin.seekg(from);
+    fin.read(buf, offset - from);
+    for(std::streamsize k = 0; k < fin.gcount(); ++k) {
+        h ^= (unsigned char) buf[k];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Finishes a file written to `tmpName` and renames it over `filename`.
+// rename is atomic, so a crash leaves either the old or the new file.
+bool commitTempFile(std::ofstream &fout, const std::string &tmpName, const std::string &filename) {
+    fout.close();
+    if(!fout || std::rename(tmpName.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Could not write " << filename << "\n";
+        std::remove(tmpName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// --------------------------------------------------
+// Catalog storage. Books are kept column-wise instead of one object with
+// five std::strings each: a status byte, the year, interned author and
+// publisher ids, and ISBN/title views into an append-only string arena.
+// Status/author/year scans and saveBooks walk small contiguous arrays
+// instead of ~200 byte records full of heap pointers.
+// --------------------------------------------------
+
+// Append-only character storage. Chunks never move, so the views it hands
+// out stay valid until clear().
+class StringArena {
+private:
+    static const std::size_t kChunkSize = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    std::vector<std::unique_ptr<char[]>> bigChunks; // strings too long to share a chunk
+    std::size_t used = kChunkSize; // bytes used in chunks.back()
+public:
+    std::string_view store(std::string_view s) {
+        if(s.empty()) return std::string_view();
+        char *p;
+        if(s.size() > kChunkSize / 4) {
+            bigChunks.emplace_back(new char[s.size()]);
+            p = bigChunks.back().get();
+        } else {
+            if(used + s.size() > kChunkSize) {
+                chunks.emplace_back(new char[kChunkSize]);
+                used = 0;
+            }
+            p = chunks.back().get() + used;
+            used += s.size();
+        }
+        std::memcpy(p, s.data(), s.size());
+        return std::string_view(p, s.size());
+    }
+
+    void clear() {
+        chunks.clear();
+        bigChunks.clear();
+        used = kChunkSize;
+    }
+};
+
+// Maps strings that repeat a lot (authors, publishers) to small ids
+class StringInterner {
+private:
+    StringArena arena;
+    std::vector<std::string_view> strings;
+    std::unordered_map<std::string_view, std::uint32_t> ids;
+public:
+    std::uint32_t intern(std::string_view s) {
+        auto it = ids.find(s);
+        if(it != ids.end()) return it->second;
+        std::string_view stored = arena.store(s);
+        std::uint32_t id = (std::uint32_t) strings.size();
+        strings.push_back(stored);
+        ids.emplace(stored, id);
+        return id;
+    }
+
+    std::string_view get(std::uint32_t id) const { return strings[id]; }
+    std::size_t size() const { return strings.size(); }
+
+    void clear() {
+        ids.clear();
+        strings.clear();
+        arena.clear();
+    }
+};
+
+// A book's waiting list, first come first served. Taking the head is O(1):
+// it only moves `head`, and the vector is compacted once the taken part
+// dominates.
+struct Reservation {
+    std::string uid;
+    std::int32_t day; // when it was placed
+};
+
+class ReservationQueue {
+private:
+    std::vector<Reservation> items;
+    std::uint32_t head = 0;
+public:
+    bool empty() const { return head == items.size(); }
+    std::size_t size() const { return items.size() - head; }
+    const Reservation& operator[](std::size_t k) const { return items[head + k]; }
+
+    void push(std::string_view uid, long long day) {
+        items.push_back(Reservation{std::string(uid), (std::int32_t) day});
+    }
+
+    void pop() {
+        if(++head == items.size()) {
+            clear();
+        } else if(head >= 16 && head * 2 >= items.size()) {
+            items.erase(items.begin(), items.begin() + head);
+            head = 0;
+        }
+    }
+
+    // position of uid's entry, or size() if it isn't waiting
+    std::size_t find(std::string_view uid) const {
+        for(std::size_t k = head; k < items.size(); ++k) {
+            if(items[k].uid == uid) return k - head;
+        }
+        return size();
+    }
+
+    void erase(std::size_t k) {
+        items.erase(items.begin() + head + k);
+        if(empty()) clear();
+    }
+
+    void clear() {
+        items.clear();
+        head = 0;
+    }
+
+    // "uid:day;uid:day", the checkpoint form
+    std::string encode() const {
+        std::string out;
+        for(std::size_t k = head; k < items.size(); ++k) {
+            if(k > head) out.push_back(';');
+            out.append(items[k].uid).append(":").append(std::to_string(items[k].day));
+        }
+        return out;
+    }
+
+    // user ids only, in queue order
+    std::string holders(std::string_view sep) const {
+        std::string out;
+        for(std::size_t k = head; k < items.size(); ++k) {
+            if(k > head) out.append(sep);
+            out.append(items[k].uid);
+        }
+        return out;
+    }
+};
+
+// Copy-on-write pages of per-slot values, for reports that need a
+// point-in-time view while checkouts go on. Writers mark a slot's page
+// dirty when they change it (under whatever lock guards that slot);
+// refresh() copies only the dirty pages again, so consecutive views share
+// every page nobody touched and taking one costs O(changes), not O(slots).
+template <typename T>
+class SnapshotPages {
+public:
+    static const std::size_t kPageSize = 256;
+    using Page = std::vector<T>;
+    using View = std::vector<std::shared_ptr<const Page>>;
+
+    static const T& at(const View &v, std::size_t slot) { return (*v[slot / kPageSize])[slot % kPageSize]; }
+
+    // Covers slots [0, slots); new pages start dirty. Caller keeps everyone
+    // else out (it is appending slots).
+    void grow(std::size_t slots) {
+        while(dirty.size() * kPageSize < slots) dirty.emplace_back(true);
+    }
+
+    void markDirty(std::size_t slot) { dirty[slot / kPageSize].store(true, std::memory_order_relaxed); }
+
+    // Recopies the dirty pages with read(slot) and returns the current
+    // view. Caller keeps writers out until it returns, and calls it from
+    // one thread at a time.
+    template <typename Read>
+    View refresh(std::size_t slots, Read &&read) {
+        grow(slots);
+        std::size_t n = (slots + kPageSize - 1) / kPageSize;
+        pages.resize(n);
+        for(std::size_t p = 0; p < n; ++p) {
+            std::size_t end = std::min(slots, (p + 1) * kPageSize);
+            if(pages[p] && pages[p]->size() == end - p * kPageSize &&
+               !dirty[p].exchange(false, std::memory_order_relaxed)) continue;
+            dirty[p].store(false, std::memory_order_relaxed);
+            auto page = std::make_shared<Page>();
+            page->reserve(end - p * kPageSize);
+            for(std::size_t s = p * kPageSize; s < end; ++s) page->push_back(read(s));
+            pages[p] = std::move(page);
+        }
+        return pages;
+    }
+
+    void clear() {
+        dirty.clear();
+        pages.clear();
+    }
+private:
+    std::deque<std::atomic<bool>> dirty; // a deque, so growing never moves the flags
+    View pages;
+};
+
+// What a book report needs that changes under the book's lock stripe
+struct BookState {
+    bool removed;
+    BookStatus status;
+    ReservationQueue waitlist;
+};
+
+// Title, author, publisher and year of one book, as owned strings (the
+// lazy catalog's cache entries)
+struct BookMetadata {
+    std::string title, author, publisher;
+    int year = 0;
+};
+
+// The same as views: into the catalog's columns, into its source file, or
+// into the cache entry `pin` keeps alive
+struct BookMeta {
+    std::string_view title, author, publisher;
+    int year = 0;
+    std::shared_ptr<const BookMetadata> pin;
+};
+
+// Parses "ISBN,Title,Author,Publisher,Year..." (books.txt and the
+// checkpoint's B records from the ISBN on)
+BookMeta parseBookRecord(std::string_view rest) {
+    std::string_view line, f[5];
+    BookMeta m;
+    nextLine(rest, line);
+    if(splitFields(line, f, 5) < 5) return m;
+    m.title = f[1];
+    m.author = f[2];
+    m.publisher = f[3];
+    parseNumber(f[4], m.year);
+    return m;
+}
+
+// Bounded LRU of book records read from the source file, sharded by slot
+// so concurrent readers rarely meet on a lock. Entries are shared, so one
+// evicted while it is being formatted stays alive until that is done.
+class MetadataCache {
+private:
+    static const std::size_t kShards = 16;
+    using Entry = std::pair<std::size_t, std::shared_ptr<const BookMetadata>>;
+    struct Shard {
+        std::mutex m;
+        std::list<Entry> lru; // most recently used first
+        std::unordered_map<std::size_t, std::list<Entry>::iterator> where;
+    };
+    Shard shards[kShards];
+    std::size_t perShard = 1;
+    std::atomic<std::uint64_t> hitCount{0}, missCount{0};
+public:
+    void setCapacity(std::size_t records) { perShard = std::max<std::size_t>(1, records / kShards); }
+    std::size_t capacity() const { return perShard * kShards; }
+    std::uint64_t hits() const { return hitCount.load(std::memory_order_relaxed); }
+    std::uint64_t misses() const { return missCount.load(std::memory_order_relaxed); }
+
+    // The record for `slot`, calling load() (outside the lock) if it isn't cached
+    template <typename Load>
+    std::shared_ptr<const BookMetadata> get(std::size_t slot, Load &&load) {
+        Shard &s = shards[slot % kShards];
+        {
+            std::lock_guard<std::mutex> lock(s.m);
+            auto it = s.where.find(slot);
+            if(it != s.where.end()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                hitCount.fetch_add(1, std::memory_order_relaxed);
+                return it->second->second;
+            }
+        }
+        missCount.fetch_add(1, std::memory_order_relaxed);
+        std::shared_ptr<const BookMetadata> rec = load();
+        std::lock_guard<std::mutex> lock(s.m);
+        auto it = s.where.find(slot);
+        if(it != s.where.end()) return it->second->second; // someone else loaded it meanwhile
+        s.lru.emplace_front(slot, rec);
+        s.where[slot] = s.lru.begin();
+        while(s.lru.size() > perShard) {
+            s.where.erase(s.lru.back().first);
+            s.lru.pop_back();
+        }
+        return rec;
+    }
+
+    void erase(std::size_t slot) {
+        Shard &s = shards[slot % kShards];
+        std::lock_guard<std::mutex> lock(s.m);
+        auto it = s.where.find(slot);
+        if(it == s.where.end()) return;
+        s.lru.erase(it->second);
+        s.where.erase(it);
+    }
+
+    void clear() {
+        for(auto &s : shards) {
+            std::lock_guard<std::mutex> lock(s.m);
+            s.lru.clear();
+            s.where.clear();
+        }
+    }
+};
+
+// Slot ids are stable: books are only ever appended, removed ones are
+// tombstoned. Columns only grow under the exclusive catalog lock; a book's
+// status and waiting list change under its lock stripe, which is why status
+// is a byte per book and not a bit (neighbours may use other stripes).
+//
+// In lazy mode (setLazy) books loaded from a file keep only their ISBN,
+// status, waiting list and the offset of their record in that file, which
+// stays mapped. Title, author, publisher and year are read back on demand
+// through a bounded LRU cache. Books added or edited later are "resident":
+// their metadata lives in the columns, as it does for every book otherwise.
+class BookCatalog {
+private:
+    enum : unsigned char { FLAG_BORROWED = 1, FLAG_REMOVED = 2 };
+    static const std::uint64_t kResident = 1ULL << 63; // else: offset into source
+    std::vector<unsigned char> flags;
+    std::vector<std::string_view> isbns;
+    std::vector<ReservationQueue> waitlists;
+    SnapshotPages<BookState> states;    // status + waiting list, for reports
+    // metadata columns, one row per resident book (row = slot unless lazy)
+    std::vector<int> years;
+    std::vector<std::uint32_t> authorIds;
+    std::vector<std::uint32_t> publisherIds;
+    std::vector<std::string_view> titles;
+    StringArena text;                   // ISBNs and titles
+    StringInterner authors;
+    StringInterner publishers;
+    // lazy mode
+    bool lazy = false;
+    std::vector<std::uint64_t> locations; // per slot: kResident | row, or source offset
+    std::unique_ptr<MappedFile> source;
+    mutable MetadataCache cache;
+
+    std::size_t row(std::size_t id) const { return lazy ? (std::size_t) (locations[id] & ~kResident) : id; }
+
+    BookMeta residentMeta(std::size_t r) const {
+        BookMeta m;
+        m.title = titles[r];
+        m.author = authors.get(authorIds[r]);
+        m.publisher = publishers.get(publisherIds[r]);
+        m.year = years[r];
+        return m;
+    }
+
+    std::size_t appendRow(std::string_view title, std::string_view author, std::string_view publisher, int year) {
+        years.push_back(year);
+        authorIds.push_back(authors.intern(author));
+        publisherIds.push_back(publishers.intern(publisher));
+        titles.push_back(text.store(title));
+        return titles.size() - 1;
+    }
+
+    // Copies a file-backed book's metadata into the columns before an edit
+    std::size_t makeResident(std::size_t id) {
+        if(isResident(id)) return row(id);
+        BookMeta m = meta(id);
+        locations[id] = kResident | appendRow(m.title, m.author, m.publisher, m.year);
+        cache.erase(id);
+        return row(id);
+    }
+
+    std::size_t appendSlot(std::string_view isbn, BookStatus st, std::uint64_t location) {
+        flags.push_back(st == BookStatus::BORROWED ? FLAG_BORROWED : 0);
+        isbns.push_back(text.store(isbn));
+        waitlists.emplace_back();
+        if(lazy) locations.push_back(location);
+        states.grow(flags.size());
+        states.markDirty(flags.size() - 1);
+        return flags.size() - 1;
+    }
+public:
+    std::size_t size() const { return flags.size(); }
+
+    // Takes effect at the next clear(); `cacheRecords` bounds the cache
+    void setLazy(std::size_t cacheRecords) {
+        lazy = true;
+        cache.setCapacity(cacheRecords);
+    }
+    bool isLazy() const { return lazy; }
+    bool isResident(std::size_t id) const { return !lazy || (locations[id] & kResident); }
+    const MetadataCache& metadataCache() const { return cache; }
+
+    std::size_t append(std::string_view isbn, std::string_view title, std::string_view author,
+                       std::string_view publisher, int year, BookStatus st) {
+        std::size_t r = appendRow(title, author, publisher, year);
+        return appendSlot(isbn, st, kResident | r);
+    }
+
+    // Lazy mode: a book whose record starts at `offset` in the file handed
+    // to setSource() once loading is done
+    std::size_t appendFromSource(std::string_view isbn, std::size_t offset, BookStatus st) {
+        return appendSlot(isbn, st, offset);
+    }
+
+    // Lazy mode: keeps the file the loaded offsets point into
+    void setSource(std::unique_ptr<MappedFile> file) {
+        source = std::move(file);
+        source->dropPages();
+    }
+
+    void clear() {
+        flags.clear();
+        isbns.clear();
+        waitlists.clear();
+        states.clear();
+        years.clear();
+        authorIds.clear();
+        publisherIds.clear();
+        titles.clear();
+        text.clear();
+        authors.clear();
+        publishers.clear();
+        locations.clear();
+        source.reset();
+        cache.clear();
+    }
+
+    std::string_view isbn(std::size_t id)      const { return isbns[id]; }
+    // Resident books only; see meta() for the rest
+    std::uint32_t authorId(std::size_t id)     const { return authorIds[row(id)]; }
+    bool isRemoved(std::size_t id)             const { return flags[id] & FLAG_REMOVED; }
+    BookStatus status(std::size_t id) const {
+        return (flags[id] & FLAG_BORROWED) ? BookStatus::BORROWED : BookStatus::AVAILABLE;
+    }
+
+    // One book's metadata; lazy file-backed books go through the cache
+    BookMeta meta(std::size_t id) const {
+        if(isResident(id)) return residentMeta(row(id));
+        auto rec = cache.get(id, [this, id] {
+            BookMeta m = parseBookRecord(source->view().substr(locations[id]));
+            return std::make_shared<const BookMetadata>(
+                BookMetadata{std::string(m.title), std::string(m.author), std::string(m.publisher), m.year});
+        });
+        BookMeta m;
+        m.title = rec->title;
+        m.author = rec->author;
+        m.publisher = rec->publisher;
+        m.year = rec->year;
+        m.pin = std::move(rec);
+        return m;
+    }
+
+    // For passes over many books: reads file-backed records straight from
+    // the source instead of through the cache, so a full listing neither
+    // evicts the hot records nor allocates per book. The pages it touched
+    // are given back when it goes away. Views stay valid until clear().
+    class Scan {
+    private:
+        const BookCatalog &cat;
+    public:
+        explicit Scan(const BookCatalog &c) : cat(c) {}
+        ~Scan() { if(cat.source) cat.source->dropPages(); }
+        Scan(const Scan&) = delete;
+        Scan& operator=(const Scan&) = delete;
+
+        BookMeta meta(std::size_t id) const {
+            if(cat.isResident(id)) return cat.residentMeta(cat.row(id));
+            return parseBookRecord(cat.source->view().substr(cat.locations[id]));
+        }
+    };
+
+    const ReservationQueue& waitlist(std::size_t id) const { return waitlists[id]; }
+    // handing out the list for writing counts as changing it, so only ask
+    // for it right where the list changes
+    ReservationQueue& editWaitlist(std::size_t id) {
+        states.markDirty(id);
+        return waitlists[id];
+    }
+    // names of the resident books' authors
+    const StringInterner& authorNames() const { return authors; }
+
+    void setStatus(std::size_t id, BookStatus st) {
+        if(st == BookStatus::BORROWED) flags[id] |= FLAG_BORROWED;
+        else flags[id] &= (unsigned char) ~FLAG_BORROWED;
+        states.markDirty(id);
+    }
+    void markRemoved(std::size_t id) {
+        flags[id] |= FLAG_REMOVED;
+        if(!isResident(id)) cache.erase(id);
+    }
+
+    // Point-in-time status and waiting lists of all books. Caller holds
+    // every book lock stripe.
+    SnapshotPages<BookState>::View snapshotStates() {
+        return states.refresh(size(), [this](std::size_t id) {
+            return BookState{isRemoved(id), status(id), waitlists[id]};
+        });
+    }
+
+    // the old text stays in the arena until the catalog is reloaded
+    void setTitle(std::size_t id, std::string_view t)     { titles[makeResident(id)] = text.store(t); }
+    void setAuthor(std::size_t id, std::string_view a)    { authorIds[makeResident(id)] = authors.intern(a); }
+    void setPublisher(std::size_t id, std::string_view p) { publisherIds[makeResident(id)] = publishers.intern(p); }
+    void setYear(std::size_t id, int y)                   { years[makeResident(id)] = y; }
+};
+
+// Handle to one catalog slot; cheap to copy, valid until the catalog is cleared
+class Book {
+private:
+    BookCatalog *cat;
+    std::size_t id;
+public:
+    Book(BookCatalog &c, std::size_t i) : cat(&c), id(i) {}
+
+    std::size_t getId()                const { return id; }
+    std::string_view getISBN()         const { return cat->isbn(id); }
+    BookMeta getMeta()                 const { return cat->meta(id); }
+    BookStatus getStatus()             const { return cat->status(id); }
+    std::string getStatusString()      const { return bookStatusToString(getStatus()); }
+    const ReservationQueue& waitlist() const { return cat->waitlist(id); }
+    ReservationQueue& editWaitlist()   const { return cat->editWaitlist(id); }
+    bool isRemoved()                   const { return cat->isRemoved(id); }
+
+    void setStatus(BookStatus s)            { cat->setStatus(id, s); }
+};
+
+
+// --------------------------------------------------
+// Transaction log formats. TEXT is the original "userID,ISBN,op,dayStamp"
+// line per record. BINARY starts with an 8 byte magic and a version byte,
+// followed by tagged records (all integers are LEB128 varints):
+//   0x01 len bytes           define the next user id
+//   0x02 len bytes           define the next ISBN id
+//   0x03                     reset both dictionaries and the day base
+//   0x10+op user isbn delta  a transaction; delta = zigzag(day - previous day)
+// The writer resets the dictionaries whenever it (re)opens the file and at
+// every checkpoint, so replay can start at any of those offsets.
+// --------------------------------------------------
+enum class TxOp : unsigned char { BORROW = 0, RETURN = 1, RESERVE = 2, CANCEL = 3, UNKNOWN = 255 };
+
+std::string_view txOpName(TxOp op) {
+    switch(op) {
+        case TxOp::BORROW:  return "borrow";
+        case TxOp::RETURN:  return "return";
+        case TxOp::RESERVE: return "reserve";
+        case TxOp::CANCEL:  return "cancel";
+        default:            return "unknown";
+    }
+}
+
+TxOp stringToTxOp(std::string_view s) {
+    if(s == "borrow")  return TxOp::BORROW;
+    if(s == "return")  return TxOp::RETURN;
+    if(s == "reserve") return TxOp::RESERVE;
+    if(s == "cancel")  return TxOp::CANCEL;
+    return TxOp::UNKNOWN;
+}
+
+enum class LogFormat { TEXT, BINARY };
+
+const std::string_view kBinaryLogMagic("LMSTXLOG", 8);
+const unsigned char kBinaryLogVersion = 1;
+const std::size_t kBinaryLogHeaderSize = 9;
+
+enum : unsigned char {
+    kTagDefineUser = 0x01,
+    kTagDefineIsbn = 0x02,
+    kTagReset      = 0x03,
+    kTagRecord     = 0x10
+};
+
+bool isBinaryLog(std::string_view data) {
+    return data.size() >= kBinaryLogHeaderSize && data.substr(0, 8) == kBinaryLogMagic;
+}
+
+void putVarint(std::string &out, unsigned long long v) {
+    while(v >= 0x80) {
+        out.push_back((char) ((v & 0x7F) | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char) v);
+}
+
+bool getVarint(std::string_view &in, unsigned long long &v) {
+    v = 0;
+    for(int shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        unsigned char byte = (unsigned char) in.front();
+        in.remove_prefix(1);
+        v |= (unsigned long long) (byte & 0x7F) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+struct TxRecord {
+    std::string_view uid;
+    std::string_view isbn;
+    TxOp op;
+    std::string_view opName; // as written in the log, for display
+    long long day;
+};
+
+// Dictionary state for writing binary records
+class BinaryLogEncoder {
+private:
+    std::unordered_map<std::string, unsigned long long> userIds;
+    std::unordered_map<std::string, unsigned long long> isbnIds;
+    long long prevDay;
+
+    static unsigned long long idFor(std::unordered_map<std::string, unsigned long long> &dict,
+                                    unsigned char defineTag, std::string_view key,
+                                    std::string &out) {
+        auto res = dict.emplace(std::string(key), dict.size());
+        if(res.second) {
+            out.push_back((char) defineTag);
+            putVarint(out, key.size());
+            out.append(key);
+        }
+        return res.first->second;
+    }
+public:
+    BinaryLogEncoder() : prevDay(0) {}
+
+    static std::string header() {
+        std::string h(kBinaryLogMagic);
+        h.push_back((char) kBinaryLogVersion);
+        return h;
+    }
+
+    void reset(std::string &out) {
+        userIds.clear();
+        isbnIds.clear();
+        prevDay = 0;
+        out.push_back((char) kTagReset);
+    }
+
+    void encode(std::string &out, std::string_view uid, std::string_view isbn,
+                TxOp op, long long day) {
+        unsigned long long u = idFor(userIds, kTagDefineUser, uid, out);
+        unsigned long long i = idFor(isbnIds, kTagDefineIsbn, isbn, out);
+        long long delta = day - prevDay;
+        prevDay = day;
+        out.push_back((char) (kTagRecord + (unsigned char) op));
+        putVarint(out, u);
+        putVarint(out, i);
+        putVarint(out, ((unsigned long long) delta << 1) ^ (unsigned long long) (delta >> 63));
+    }
+};
+
+// Calls fn(const TxRecord&) for each record from byte `fromOffset` on, for
+// either format. Returns false if a damaged record stopped the scan early.
+template <typename Fn>
+bool readTransactionLog(std::string_view data, std::size_t fromOffset, Fn &&fn) {
+    if(!isBinaryLog(data)) {
+        if(fromOffset > data.size()) return true;
+        std::string_view rest = data.substr(fromOffset), line;
+        while(nextLine(rest, line)) {
+            if(line.empty()) continue;
+            // userID,ISBN,operation,dayStamp
+            std::string_view f[4];
+            TxRecord rec;
+            if(splitFields(line, f, 4) < 4 || !parseNumber(f[3], rec.day)) continue;
+            rec.uid = f[0];
+            rec.isbn = f[1];
+            rec.opName = f[2];
+            rec.op = stringToTxOp(f[2]);
+            fn(rec);
+        }
+        return true;
+    }
+
+    if((unsigned char) data[8] != kBinaryLogVersion) return false;
+    std::string_view in = data.substr(std::min(data.size(), std::max(fromOffset, kBinaryLogHeaderSize)));
+    std::vector<std::string_view> userDict, isbnDict;
+    long long prevDay = 0;
+    while(!in.empty()) {
+        unsigned char tag = (unsigned char) in.front();
+        in.remove_prefix(1);
+        unsigned long long a, b, c;
+        if(tag == kTagDefineUser || tag == kTagDefineIsbn) {
+            if(!getVarint(in, a) || a > in.size()) return false;
+            (tag == kTagDefineUser ? userDict : isbnDict).push_back(in.substr(0, a));
+            in.remove_prefix(a);
+        } else if(tag == kTagReset) {
+            userDict.clear();
+            isbnDict.clear();
+            prevDay = 0;
+        } else if(tag >= kTagRecord && tag <= kTagRecord + (unsigned char) TxOp::CANCEL) {
+            if(!getVarint(in, a) || !getVarint(in, b) || !getVarint(in, c)) return false;
+            if(a >= userDict.size() || b >= isbnDict.size()) return false;
+            prevDay += (long long) (c >> 1) ^ -(long long) (c & 1);
+            TxRecord rec;
+            rec.uid = userDict[a];
+            rec.isbn = isbnDict[b];
+            rec.op = (TxOp) (tag - kTagRecord);
+            rec.opName = txOpName(rec.op);
+            rec.day = prevDay;
+            fn(rec);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Cuts data[from, end) into up to n pieces that each end on a line break.
+// Returns the piece boundaries (from, ..., data.size()).
+std::vector<std::size_t> splitAtLines(std::string_view data, std::size_t from, std::size_t n) {
+    std::vector<std::size_t> cuts{from};
+    std::size_t step = (data.size() - from) / std::max<std::size_t>(n, 1) + 1;
+    while(cuts.back() < data.size()) {
+        std::size_t at = std::min(data.size(), cuts.back() + step);
+        std::size_t nl = data.find('\n', at > 0 ? at - 1 : 0);
+        cuts.push_back(nl == std::string_view::npos ? data.size() : nl + 1);
+    }
+    return cuts;
+}
+
+// Runs fn(0) .. fn(n - 1) on n threads (the caller being one of them) and waits for all
+template <typename Fn>
+void runParallel(std::size_t n, Fn &&fn) {
+    std::vector<std::thread> threads;
+    for(std::size_t k = 1; k < n; ++k) threads.emplace_back([&fn, k] { fn(k); });
+    if(n > 0) fn(0);
+    for(auto &t : threads) t.join();
+}
+
+// Parses the lines of `data` on up to `threads` threads; parse(line, row)
+// returns false for an invalid line. Returns the rows in file order, and
+// the 1-based numbers of the invalid lines in `badLines`.
+template <typename Row, typename Parse>
+std::vector<Row> parseLinesParallel(std::string_view data, std::size_t threads, Parse parse,
+                                    std::vector<std::size_t> &badLines) {
+    std::vector<std::size_t> cuts = splitAtLines(data, 0, threads);
+    std::size_t chunks = cuts.size() - 1;
+    std::vector<std::vector<Row>> rows(chunks);
+    std::vector<std::vector<std::size_t>> bad(chunks);
+    std::vector<std::size_t> lines(chunks, 0);
+    runParallel(chunks, [&](std::size_t c) {
+        std::string_view rest = data.substr(cuts[c], cuts[c + 1] - cuts[c]), line;
+        while(nextLine(rest, line)) {
+            ++lines[c];
+            if(line.empty()) continue;
+            Row r;
+            if(parse(line, r)) rows[c].push_back(std::move(r));
+            else bad[c].push_back(lines[c]);
+        }
+    });
+    std::vector<Row> all;
+    std::size_t total = 0, lineBase = 0;
+    for(const auto &r : rows) total += r.size();
+    all.reserve(total);
+    for(std::size_t c = 0; c < chunks; ++c) {
+        std::move(rows[c].begin(), rows[c].end(), std::back_inserter(all));
+        for(std::size_t n : bad[c]) badLines.push_back(lineBase + n);
+        lineBase += lines[c];
+    }
+    return all;
+}
+
+// Bulk files are TSV if the name says so, CSV otherwise
+char delimiterFor(const std::string &filename) {
+    std::size_t dot = filename.rfind('.');
+    return (dot != std::string::npos && filename.substr(dot) == ".tsv") ? '\t' : ',';
+}
+
+// Drops a header line starting with `firstColumn` (any case); returns
+// how many lines were dropped
+std::size_t skipHeader(std::string_view &data, std::string_view firstColumn) {
+    std::string_view rest = data, line;
+    if(!nextLine(rest, line) || line.size() < firstColumn.size()) return 0;
+    for(std::size_t k = 0; k < firstColumn.size(); ++k) {
+        if(std::tolower((unsigned char) line[k]) != std::tolower((unsigned char) firstColumn[k])) return 0;
+    }
+    data = rest;
+    return 1;
+}
+
+// Rewrites a transaction log in the other (or the same) format.
+bool convertTransactionLog(const std::string &inName, const std::string &outName, LogFormat format) {
+    MappedFile in(inName);
+    if(!in.is_open()) {
+        std::cerr << "Could not open " << inName << "\n";
+        return false;
+    }
+    std::string out;
+    BinaryLogEncoder encoder;
+    std::size_t records = 0, skipped = 0;
+    if(format == LogFormat::BINARY) {
+        out = BinaryLogEncoder::header();
+        encoder.reset(out);
+    }
+    bool intact = readTransactionLog(in.view(), 0, [&](const TxRecord &rec) {
+        if(format == LogFormat::BINARY) {
+            if(rec.op == TxOp::UNKNOWN) { ++skipped; return; }
+            encoder.encode(out, rec.uid, rec.isbn, rec.op, rec.day);
+        } else {
+            out.append(rec.uid).append(",").append(rec.isbn).append(",")
+               .append(rec.opName).append(",").append(std::to_string(rec.day)).append("\n");
+        }
+        ++records;
+    });
+    if(!intact) std::cerr << "Warning: " << inName << " is damaged; converted the readable part.\n";
+
+    std::ofstream fout(outName, std::ios::binary | std::ios::trunc);
+    if(!fout.is_open()) {
+        std::cerr << "Could not open " << outName << "\n";
+        return false;
+    }
+    fout.write(out.data(), (std::streamsize) out.size());
+    fout.close();
+    std::cout << "Converted " << records << " records (" << in.view().size()
+              << " -> " << out.size() << " bytes)";
+    if(skipped) std::cout << ", skipped " << skipped << " with unknown operations";
+    std::cout << "\n";
+    return (bool) fout;
+}
+
+// --------------------------------------------------
+// Append-only writer for transactions.txt. The file stays open for the whole
+// session and records are batched in memory; how often they reach the disk
+// is set by LogDurability.
+// --------------------------------------------------
+struct LogDurability {
+    std::size_t flushEveryRecords = 1; // hand the batch to the OS after this many records
+    long flushIntervalMs = 0;          // also flush at least this often (0 = no timer)
+    bool fsyncEachCommit = false;      // write + fsync every record before returning
+};
+
+class TransactionLog {
+private:
+    std::FILE* file;
+    LogDurability durability;
+    LogFormat format;
+    BinaryLogEncoder encoder;
+    long long fileOffset; // bytes in the file, excluding what is still buffered
+    std::string buffer;
+    std::size_t pending;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::thread flusher;
+    bool stopping;
+    bool failing = false;                  // the last flush didn't get everything out
+    std::atomic<std::uint64_t> failedFlushes{0};
+
+    // Caller holds mtx. Whatever the file doesn't take stays buffered for
+    // the next flush; false if that happened or the data didn't reach the disk.
+    bool flushLocked(bool sync) {
+        if(!file) return false;
+        bool ok = true;
+        if(!buffer.empty()) {
+            std::size_t n = std::fwrite(buffer.data(), 1, buffer.size(), file);
+            fileOffset += (long long) n;
+            buffer.erase(0, n);
+            ok = buffer.empty();
+        }
+        if(ok) pending = 0;
+        ok = (std::fflush(file) == 0) && ok;
+#ifdef LIBRARY_HAVE_POSIX
+        if(sync && ::fsync(::fileno(file)) != 0) ok = false;
+#else
+        (void) sync;
+#endif
+        if(!ok) {
+            failedFlushes.fetch_add(1, std::memory_order_relaxed);
+            // once per failure streak, the log may be failing on every record
+            if(!failing) std::cerr << "Transaction log write failed: " << std::strerror(errno)
+                                   << "; keeping " << buffer.size() << " bytes to retry\n";
+            std::clearerr(file);
+        } else if(failing) {
+            std::cerr << "Transaction log writes are going through again.\n";
+        }
+        failing = !ok;
+        return ok;
+    }
+
+    void flusherLoop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while(!stopping) {
+            wake.wait_for(lock, std::chrono::milliseconds(durability.flushIntervalMs));
+            if(pending > 0) flushLocked(false);
+        }
+    }
+
+public:
+    TransactionLog()
+        : file(nullptr), format(LogFormat::TEXT), fileOffset(0), pending(0), stopping(false) {}
+    ~TransactionLog() { close(); }
+    TransactionLog(const TransactionLog&) = delete;
+    TransactionLog& operator=(const TransactionLog&) = delete;
+
+    // An existing log keeps its format; `newFormat` only applies to a new/empty file.
+    bool open(const std::string &filename, const LogDurability &d = LogDurability(),
+              LogFormat newFormat = LogFormat::TEXT) {
+        close();
+        char head[kBinaryLogHeaderSize];
+        std::ifstream probe(filename, std::ios::binary);
+        probe.read(head, sizeof(head));
+        bool empty = (probe.gcount() == 0);
+        format = isBinaryLog(std::string_view(head, (std::size_t) probe.gcount()))
+                 ? LogFormat::BINARY : (empty ? newFormat : LogFormat::TEXT);
+        probe.close();
+
+        file = std::fopen(filename.c_str(), "ab");
+        if(!file) return false;
+        // we do our own batching, so skip stdio's buffer
+        std::setvbuf(file, nullptr, _IONBF, 0);
+        std::fseek(file, 0, SEEK_END);
+        fileOffset = std::ftell(file);
+        buffer.clear();
+        if(format == LogFormat::BINARY) {
+            if(empty) buffer = BinaryLogEncoder::header();
+            encoder.reset(buffer);
+        }
+        durability = d;
+        if(durability.flushEveryRecords == 0) durability.flushEveryRecords = 1;
+        stopping = false;
+        if(durability.flushIntervalMs > 0) {
+            flusher = std::thread(&TransactionLog::flusherLoop, this);
+        }
+        return true;
+    }
+
+    bool is_open() const { return file != nullptr; }
+
+    // Flushes that left records unwritten or unsynced (since open)
+    std::uint64_t failures() const { return failedFlushes.load(std::memory_order_relaxed); }
+
+    // Bytes in the log including what is still buffered
+    long long size() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return fileOffset + (long long) buffer.size();
+    }
+
+    // False if a flush this record triggered failed; the record is then
+    // still in memory, and retried with the next flush
+    bool append(std::string_view uid, std::string_view isbn, TxOp op, long long day) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(format == LogFormat::BINARY) {
+            encoder.encode(buffer, uid, isbn, op, day);
+        } else {
+            buffer.append(uid).append(",").append(isbn).append(",").append(txOpName(op))
+                  .append(",").append(std::to_string(day)).append("\n");
+        }
+        ++pending;
+        if(durability.fsyncEachCommit) return flushLocked(true);
+        if(pending >= durability.flushEveryRecords) return flushLocked(false);
+        return !failing;
+    }
+
+    // Pushes everything buffered to the file (e.g. before the file is read)
+    bool flush() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return flushLocked(durability.fsyncEachCommit);
+    }
+
+    // Flushes and returns the offset a checkpoint can resume replay from, or
+    // -1 if records are stuck in memory (they'd be past the offset, yet
+    // already in the checkpoint). Binary logs start a fresh dictionary there
+    // so the tail decodes alone.
+    long long checkpointOffset() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(!flushLocked(durability.fsyncEachCommit)) return -1;
+        long long offset = fileOffset;
+        if(file && format == LogFormat::BINARY) {
+            encoder.reset(buffer);
+            flushLocked(durability.fsyncEachCommit);
+        }
+        return offset;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        if(flusher.joinable()) flusher.join();
+        std::lock_guard<std::mutex> lock(mtx);
+        if(file) {
+            flushLocked(true);
+            std::fclose(file);
+            file = nullptr;
+        }
+    }
+};
+
+
+// --------------------------------------------------
+// Hot-path metrics. Every thread counts into its own shard (plain relaxed
+// load + store, no locked instructions), and a read sums all shards. Each
+// metric has a call count and a latency histogram with power-of-two
+// nanosecond buckets. Cheap lookups are timed on one call in
+// kLookupSampleEvery, since reading the clock costs more than the lookup.
+// --------------------------------------------------
+enum class Metric {
+    APPEND_TRANSACTION, FIND_BOOK, FIND_USER, BORROW, RETURN,
+    LOAD_BOOKS, LOAD_USERS, LOAD_TRANSACTIONS, LOAD_CHECKPOINT, LOAD_CHANGES,
+    SAVE_BOOKS, SAVE_USERS, SAVE_CHECKPOINT, SAVE_CHANGES,
+    COUNT
+};
+
+std::string_view metricName(Metric m) {
+    static const char* const names[] = {
+        "append_transaction", "find_book", "find_user", "borrow", "return",
+        "load_books", "load_users", "load_transactions", "load_checkpoint", "load_changes",
+        "save_books", "save_users", "save_checkpoint", "save_changes"};
+    return names[(int) m];
+}
+
+const unsigned kLookupSampleEvery = 64;
+
+// Merged view of one metric
+struct MetricTotals {
+    static const int kBuckets = 40; // bucket b: latencies below 2^b ns (the last one catches the rest)
+    std::uint64_t calls = 0;
+    std::uint64_t timed = 0;   // calls that were timed
+    std::uint64_t sumNs = 0;   // over the timed calls
+    std::uint64_t buckets[kBuckets] = {};
+
+    // upper bound of the bucket holding the q-quantile of the timed calls, in ns
+    double quantileNs(double q) const {
+        std::uint64_t rank = (std::uint64_t) (q * (double) timed), seen = 0;
+        for(int b = 0; b < kBuckets; ++b) {
+            seen += buckets[b];
+            if(seen > rank) return std::ldexp(1.0, b);
+        }
+        return 0;
+    }
+};
+
+class Metrics {
+private:
+    static const int N = (int) Metric::COUNT;
+    struct Shard {
+        std::atomic<std::uint64_t> calls[N];
+        std::atomic<std::uint64_t> timed[N];
+        std::atomic<std::uint64_t> sumNs[N];
+        std::atomic<std::uint64_t> buckets[N][MetricTotals::kBuckets];
+        Shard() {
+            for(int m = 0; m < N; ++m) {
+                calls[m] = 0;
+                timed[m] = 0;
+                sumNs[m] = 0;
+                for(auto &b : buckets[m]) b = 0;
+            }
+        }
+    };
+    std::mutex m;
+    std::vector<std::unique_ptr<Shard>> shards; // kept after their thread exits
+
+    // only the owning thread writes a shard, so no read-modify-write is needed
+    static void add(std::atomic<std::uint64_t> &a, std::uint64_t v) {
+        a.store(a.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    }
+
+    Shard& local() {
+        thread_local Shard* shard = nullptr;
+        if(!shard) {
+            std::lock_guard<std::mutex> lock(m);
+            shards.emplace_back(new Shard());
+            shard = shards.back().get();
+        }
+        return *shard;
+    }
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    // Counts a call; true if this one should be timed
+    bool count(Metric id, unsigned sampleEvery = 1) {
+        std::atomic<std::uint64_t> &calls = local().calls[(int) id];
+        std::uint64_t n = calls.load(std::memory_order_relaxed);
+        calls.store(n + 1, std::memory_order_relaxed);
+        return n % sampleEvery == 0;
+    }
+
+    void recordTime(Metric id, std::uint64_t ns) {
+        Shard &s = local();
+        int b = 0;
+        while(b < MetricTotals::kBuckets - 1 && (ns >> b) != 0) ++b;
+        add(s.timed[(int) id], 1);
+        add(s.sumNs[(int) id], ns);
+        add(s.buckets[(int) id][b], 1);
+    }
+
+    MetricTotals totals(Metric id) {
+        MetricTotals t;
+        std::lock_guard<std::mutex> lock(m);
+        for(auto &s : shards) {
+            t.calls += s->calls[(int) id].load(std::memory_order_relaxed);
+            t.timed += s->timed[(int) id].load(std::memory_order_relaxed);
+            t.sumNs += s->sumNs[(int) id].load(std::memory_order_relaxed);
+            for(int b = 0; b < MetricTotals::kBuckets; ++b) {
+                t.buckets[b] += s->buckets[(int) id][b].load(std::memory_order_relaxed);
+            }
+        }
+        return t;
+    }
+
+    // Human-readable table, for the librarian menu
+    void writeTable(std::ostream &os) {
+        char line[160];
+        std::snprintf(line, sizeof(line), "%-20s %12s %12s %10s %10s %10s\n",
+                      "operation", "calls", "total ms", "mean us", "p50 us", "p99 us");
+        os << line;
+        for(int k = 0; k < N; ++k) {
+            MetricTotals t = totals((Metric) k);
+            if(t.calls == 0) continue;
+            double mean = t.timed ? (double) t.sumNs / (double) t.timed : 0;
+            std::snprintf(line, sizeof(line), "%-20s %12llu %12.1f %10.2f %10.2f %10.2f\n",
+                          std::string(metricName((Metric) k)).c_str(), (unsigned long long) t.calls,
+                          mean * (double) t.calls / 1e6, mean / 1e3,
+                          t.quantileNs(0.50) / 1e3, t.quantileNs(0.99) / 1e3);
+            os << line;
+        }
+    }
+
+    // Exact decimal seconds, so no two bucket bounds print alike
+    static std::string nsToSeconds(std::uint64_t ns) {
+        std::string frac = std::to_string(1000000000ULL + ns % 1000000000ULL).substr(1);
+        while(!frac.empty() && frac.back() == '0') frac.pop_back();
+        return std::to_string(ns / 1000000000ULL) + (frac.empty() ? "" : "." + frac);
+    }
+
+    // Prometheus text exposition format
+    void writePrometheus(std::ostream &os) {
+        os << "# HELP library_calls_total Calls per operation.\n"
+           << "# TYPE library_calls_total counter\n";
+        std::vector<MetricTotals> all;
+        for(int k = 0; k < N; ++k) {
+            all.push_back(totals((Metric) k));
+            os << "library_calls_total{op=\"" << metricName((Metric) k) << "\"} " << all[k].calls << "\n";
+        }
+        os << "# HELP library_duration_seconds Latency of the timed calls per operation.\n"
+           << "# TYPE library_duration_seconds histogram\n";
+        for(int k = 0; k < N; ++k) {
+            std::string_view name = metricName((Metric) k);
+            std::uint64_t cumulative = 0;
+            for(int b = 0; b < MetricTotals::kBuckets - 1; ++b) {
+                cumulative += all[k].buckets[b];
+                os << "library_duration_seconds_bucket{op=\"" << name << "\",le=\""
+                   << nsToSeconds(1ULL << b) << "\"} " << cumulative << "\n";
+            }
+            os << "library_duration_seconds_bucket{op=\"" << name << "\",le=\"+Inf\"} " << all[k].timed << "\n"
+               << "library_duration_seconds_sum{op=\"" << name << "\"} " << nsToSeconds(all[k].sumNs) << "\n"
+               << "library_duration_seconds_count{op=\"" << name << "\"} " << all[k].timed << "\n";
+        }
+    }
+};
+
+// Counts the enclosing call and times it (or one in `sampleEvery` of them)
+class MetricTimer {
+private:
+    Metric id;
+    bool timed;
+    std::chrono::steady_clock::time_point start;
+public:
+    explicit MetricTimer(Metric m, unsigned sampleEvery = 1)
+        : id(m), timed(Metrics::instance().count(m, sampleEvery)) {
+        if(timed) start = std::chrono::steady_clock::now();
+    }
+    ~MetricTimer() {
+        if(!timed) return;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        Metrics::instance().recordTime(id, (std::uint64_t) ns);
+    }
+    MetricTimer(const MetricTimer&) = delete;
+    MetricTimer& operator=(const MetricTimer&) = delete;
+};
+
+
+// Rewrites a Prometheus text file with the current metrics every
+// `intervalSec` seconds, and once more when stopped
+class MetricsDumper {
+private:
+    std::string filename;
+    long intervalSec;
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::thread thread;
+    bool stopping = false;
+
+    void dump() {
+        std::string tmpName = filename + ".tmp";
+        std::ofstream fout(tmpName);
+        if(!fout.is_open()) return;
+        Metrics::instance().writePrometheus(fout);
+        commitTempFile(fout, tmpName, filename);
+    }
+
+    void loop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while(!stopping) {
+            wake.wait_for(lock, std::chrono::seconds(intervalSec));
+            lock.unlock();
+            dump();
+            lock.lock();
+        }
+    }
+public:
+    MetricsDumper(std::string file, long interval)
+        : filename(std::move(file)), intervalSec(std::max(1L, interval)) {
+        thread = std::thread(&MetricsDumper::loop, this);
+    }
+    ~MetricsDumper() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        thread.join();
+    }
+    MetricsDumper(const MetricsDumper&) = delete;
+    MetricsDumper& operator=(const MetricsDumper&) = delete;
+};
+
+
+// --------------------------------------------------
+// Inverted index over title, author and publisher. Tokens are lower-cased
+// runs of letters/digits; every token maps to the sorted ids (slots in
+// Library::books) of the books containing it plus which fields it was in.
+// Kept up to date on every add/update/remove, never rebuilt.
+// --------------------------------------------------
+class SearchIndex {
+public:
+    enum Field : unsigned char { TITLE = 1, AUTHOR = 2, PUBLISHER = 4 };
+
+    struct Hit {
+        std::size_t id;
+        int score;
+    };
+
+private:
+    struct Posting {
+        std::size_t id;
+        unsigned char fields;
+    };
+    std::map<std::string, std::vector<Posting>, std::less<>> postings;
+
+    template <typename Fn>
+    static void forEachToken(std::string_view text, Fn &&fn) {
+        std::string token;
+        for(std::size_t k = 0; k <= text.size(); ++k) {
+            unsigned char c = (k < text.size()) ? (unsigned char) text[k] : ' ';
+            if(std::isalnum(c) || c >= 0x80) {
+                token.push_back((char) std::tolower(c));
+            } else if(!token.empty()) {
+                fn(token);
+                token.clear();
+            }
+        }
+    }
+
+    // token -> fields it appears in, for one book
+    static std::map<std::string, unsigned char> tokenize(std::string_view title,
+                                                         std::string_view author,
+                                                         std::string_view publisher) {
+        std::map<std::string, unsigned char> tokens;
+        forEachToken(title,     [&](const std::string &t) { tokens[t] |= TITLE; });
+        forEachToken(author,    [&](const std::string &t) { tokens[t] |= AUTHOR; });
+        forEachToken(publisher, [&](const std::string &t) { tokens[t] |= PUBLISHER; });
+        return tokens;
+    }
+
+    static int fieldWeight(unsigned char fields) {
+        return ((fields & TITLE) ? 3 : 0) + ((fields & AUTHOR) ? 2 : 0) + ((fields & PUBLISHER) ? 1 : 0);
+    }
+
+public:
+    void clear() { postings.clear(); }
+
+    void add(std::size_t id, std::string_view title, std::string_view author,
+             std::string_view publisher) {
+        for(const auto &kv : tokenize(title, author, publisher)) {
+            auto &list = postings[kv.first];
+            // ids mostly arrive in increasing order, so this is usually a push_back
+            auto pos = std::lower_bound(list.begin(), list.end(), id,
+                                        [](const Posting &p, std::size_t v) { return p.id < v; });
+            list.insert(pos, Posting{id, kv.second});
+        }
+    }
+
+    void remove(std::size_t id, std::string_view title, std::string_view author,
+                std::string_view publisher) {
+        for(const auto &kv : tokenize(title, author, publisher)) {
+            auto it = postings.find(kv.first);
+            if(it == postings.end()) continue;
+            auto &list = it->second;
+            auto pos = std::lower_bound(list.begin(), list.end(), id,
+                                        [](const Posting &p, std::size_t v) { return p.id < v; });
+            if(pos != list.end() && pos->id == id) list.erase(pos);
+            if(list.empty()) postings.erase(it);
+        }
+    }
+
+    // Books matching every query word, as a whole word or as a prefix
+    // (whole words and title matches rank higher). Best `limit` hits first.
+    std::vector<Hit> search(std::string_view query, std::size_t limit) const {
+        std::vector<std::string> terms;
+        forEachToken(query, [&](const std::string &t) { terms.push_back(t); });
+        std::unordered_map<std::size_t, int> scores;
+        for(std::size_t t = 0; t < terms.size(); ++t) {
+            std::unordered_map<std::size_t, int> termScores;
+            for(auto it = postings.lower_bound(terms[t]);
+                it != postings.end() && it->first.compare(0, terms[t].size(), terms[t]) == 0; ++it) {
+                int boost = (it->first.size() == terms[t].size()) ? 2 : 1;
+                for(const auto &p : it->second) {
+                    int s = fieldWeight(p.fields) * boost;
+                    int &best = termScores[p.id];
+                    best = std::max(best, s);
+                }
+            }
+            if(t == 0) {
+                scores.swap(termScores);
+                continue;
+            }
+            // keep only books that matched the earlier words too
+            for(auto it = scores.begin(); it != scores.end(); ) {
+                auto m = termScores.find(it->first);
+                if(m == termScores.end()) {
+                    it = scores.erase(it);
+                } else {
+                    it->second += m->second;
+                    ++it;
+                }
+            }
+        }
+
+        std::vector<Hit> hits;
+        hits.reserve(scores.size());
+        for(const auto &kv : scores) hits.push_back(Hit{kv.first, kv.second});
+        auto better = [](const Hit &a, const Hit &b) {
+            return a.score != b.score ? a.score > b.score : a.id < b.id;
+        };
+        if(hits.size() > limit) {
+            std::partial_sort(hits.begin(), hits.begin() + (std::ptrdiff_t) limit, hits.end(), better);
+            hits.resize(limit);
+        } else {
+            std::sort(hits.begin(), hits.end(), better);
+        }
+        return hits;
+    }
+};
+
+// Fields left unset (year: 0) are not changed
+struct BookUpdate {
+    std::optional<std::string> title, author, publisher;
+    int year = 0;
+};
+
+
+// Outcome of a Library operation that doesn't talk to the console
+enum class OpStatus { OK, NOT_FOUND, DENIED, RESERVABLE, INVALID, THROTTLED };
+
+std::string_view opStatusName(OpStatus st) {
+    switch(st) {
+        case OpStatus::OK:         return "OK";
+        case OpStatus::NOT_FOUND:  return "NOT_FOUND";
+        case OpStatus::DENIED:     return "DENIED";
+        case OpStatus::RESERVABLE: return "RESERVABLE";
+        case OpStatus::THROTTLED:  return "THROTTLED";
+        default:                   return "INVALID";
+    }
+}
+
+struct OpResult {
+    OpStatus status = OpStatus::OK;
+    std::string message; // one or more lines, each ending in '\n'
+
+    void addLine(const std::string &line) { message.append(line).append("\n"); }
+
+    static OpResult ok(const std::string &msg) {
+        OpResult r;
+        if(!msg.empty()) r.addLine(msg);
+        return r;
+    }
+    static OpResult fail(OpStatus st, const std::string &msg) {
+        OpResult r;
+        r.status = st;
+        r.addLine(msg);
+        return r;
+    }
+};
+
+// Same formatting std::cout uses for fines
+std::string formatAmount(double v) {
+    std::ostringstream os;
+    os << v;
+    return os.str();
+}
+
+// Formats into one buffer and hands it to the stream in large writes,
+// instead of one operator<< call chain per field
+class OutputBuffer {
+private:
+    std::ostream &os;
+    std::string buf;
+    static const std::size_t kFlushAt = 1 << 16;
+
+    template <typename T>
+    OutputBuffer& putInt(T v) {
+        char tmp[24];
+        auto res = std::to_chars(tmp, tmp + sizeof(tmp), v);
+        return *this << std::string_view(tmp, (std::size_t) (res.ptr - tmp));
+    }
+public:
+    explicit OutputBuffer(std::ostream &o) : os(o) { buf.reserve(kFlushAt + 1024); }
+    ~OutputBuffer() { flush(); }
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    OutputBuffer& operator<<(std::string_view s) {
+        buf.append(s);
+        if(buf.size() >= kFlushAt) flush();
+        return *this;
+    }
+    OutputBuffer& operator<<(int v)           { return putInt(v); }
+    OutputBuffer& operator<<(long long v)     { return putInt(v); }
+    OutputBuffer& operator<<(unsigned long v) { return putInt(v); }
+    OutputBuffer& operator<<(double v)        { return *this << formatAmount(v); }
+
+    void flush() {
+        os.write(buf.data(), (std::streamsize) buf.size());
+        buf.clear();
+        os.flush();
+    }
+};
+
+// --------------------------------------------------
+// Paged catalog listing. A cursor is 0 for the first page, otherwise
+// (id of the last book shown + 1); the next page continues right after that
+// book in the chosen order, so each page costs O(page size).
+// --------------------------------------------------
+enum class BookSort { CATALOG, ISBN, TITLE, AUTHOR, YEAR };
+
+struct BookFilter {
+    std::optional<BookStatus> status;
+    std::string author; // whole author name, case-insensitive; empty = any
+    int yearFrom = std::numeric_limits<int>::min();
+    int yearTo = std::numeric_limits<int>::max();
+};
+
+struct BookPage {
+    std::vector<std::size_t> ids;
+    std::size_t nextCursor = 0; // 0 = no more pages
+};
+
+bool equalsIgnoreCase(std::string_view a, std::string_view b) {
+    if(a.size() != b.size()) return false;
+    for(std::size_t k = 0; k < a.size(); ++k) {
+        if(std::tolower((unsigned char) a[k]) != std::tolower((unsigned char) b[k])) return false;
+    }
+    return true;
+}
+
+
+class Library {
+private:
+    // Removed books are tombstoned, not erased, so slot ids stay valid
+    BookCatalog books;
+    UserPool userPool; // owns everything in users
+    std::vector<User*> users;
+    HistorySpill historySpill;
+
+    DueQueue dueQueue;
+    std::mutex sweepMutex;
+    std::atomic<long long> sweptThrough{-1}; // last day the due sweep covered
+
+    // ISBN -> slot in books, userID -> user. Keys view the ISBN in the
+    // catalog arena / the ID owned by the User (those never move and are
+    // never changed while indexed), so lookups don't copy anything.
+    std::unordered_map<std::string_view, std::size_t> bookIndex;
+    std::unordered_map<std::string_view, User*> userIndex;
+
+    CredentialCache credentialCache;
+    LoginThrottle loginThrottle;
+
+    // Concurrency: structural changes (add/remove books or users) take
+    // catalogMutex exclusively; everything else takes it shared plus the
+    // lock stripe of each book/user it touches.
+    static const std::size_t kLockStripes = 64;
+    std::shared_mutex catalogMutex;
+    std::array<std::mutex, kLockStripes> bookLocks;
+    std::array<std::mutex, kLockStripes> userLocks;
+    std::mutex dirtyMutex;
+
+    std::mutex& bookLock(std::string_view isbn) {
+        return bookLocks[std::hash<std::string_view>()(isbn) % kLockStripes];
+    }
+    std::mutex& userLock(std::string_view uid) {
+        return userLocks[std::hash<std::string_view>()(uid) % kLockStripes];
+    }
+
+    TransactionLog txLog;
+    long long checkpointLogOffset = 0; // log offset covered by the last checkpoint
+
+    // Books/users changed since they were last persisted. Book status isn't
+    // tracked here: it is rebuilt from the transaction log.
+    std::unordered_set<std::string> dirtyBooks;
+    std::unordered_set<std::string> dirtyUsers;
+    std::size_t changeRecords = 0; // records in the change journal
+
+    void markBookDirty(const std::string &isbn) {
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        dirtyBooks.insert(isbn);
+    }
+    void markUserDirty(const User &u) {
+        userFines.markDirty(UserPool::slotIndex(&u));
+        std::lock_guard<std::mutex> lock(dirtyMutex);
+        dirtyUsers.insert(u.getUserID());
+    }
+
+    SearchIndex searchIndex;
+    // A lazy catalog builds the index on the first search instead of at load
+    bool searchStale = false; // set under the exclusive catalog lock
+    std::mutex searchMutex;
+
+    // caller holds catalogMutex (shared or exclusive)
+    void ensureSearchIndex() {
+        std::lock_guard<std::mutex> lock(searchMutex);
+        if(!searchStale) return;
+        searchIndex.clear();
+        BookCatalog::Scan scan(books);
+        for(std::size_t id = 0; id < books.size(); ++id) {
+            if(books.isRemoved(id)) continue;
+            BookMeta m = scan.meta(id);
+            searchIndex.add(id, m.title, m.author, m.publisher);
+        }
+        searchStale = false;
+    }
+
+    // Keeps a built search index up to date; caller holds catalogMutex exclusively
+    void indexForSearch(std::size_t id, bool add) {
+        if(searchStale) return; // the rebuild will see the change
+        BookMeta m = books.meta(id);
+        if(add) searchIndex.add(id, m.title, m.author, m.publisher);
+        else searchIndex.remove(id, m.title, m.author, m.publisher);
+    }
+
+    // Sorted orderings of every slot (removed ones included, so a cursor
+    // into them stays valid) and each slot's position in them. Rebuilt on
+    // the first listing after the catalog changed.
+    static const std::size_t kSortedOrders = 4; // BookSort minus CATALOG
+    std::array<std::vector<std::size_t>, kSortedOrders> orders;
+    std::array<std::vector<std::size_t>, kSortedOrders> orderRank;
+    bool ordersStale = true; // set under the exclusive catalog lock
+    std::mutex orderMutex;
+
+    // caller holds catalogMutex (shared or exclusive)
+    void ensureOrders() {
+        std::lock_guard<std::mutex> lock(orderMutex);
+        if(!ordersStale) return;
+        BookCatalog::Scan scan(books);
+        std::vector<std::string_view> text(books.size()); // sort keys, read once per book
+        std::vector<int> years(books.size());
+        for(std::size_t k = 0; k < kSortedOrders; ++k) {
+            auto &ord = orders[k];
+            ord.resize(books.size());
+            for(std::size_t id = 0; id < ord.size(); ++id) ord[id] = id;
+            BookSort sort = (BookSort) (k + 1);
+            for(std::size_t id = 0; id < books.size(); ++id) {
+                if(sort == BookSort::ISBN) text[id] = books.isbn(id);
+                else if(sort == BookSort::TITLE) text[id] = scan.meta(id).title;
+                else if(sort == BookSort::AUTHOR) text[id] = scan.meta(id).author;
+                else years[id] = scan.meta(id).year;
+            }
+            std::stable_sort(ord.begin(), ord.end(), [&](std::size_t a, std::size_t b) {
+                return (sort == BookSort::YEAR) ? years[a] < years[b] : text[a] < text[b];
+            });
+            auto &rank = orderRank[k];
+            rank.resize(ord.size());
+            for(std::size_t pos = 0; pos < ord.size(); ++pos) rank[ord[pos]] = pos;
+        }
+        ordersStale = false;
+    }
+
+    Book bookAt(std::size_t id) { return Book(books, id); }
+
+    // Appends a book and indexes it; returns its slot, or nothing on a
+    // duplicate ISBN
+    std::optional<Book> insertBook(std::string_view isbn, std::string_view title,
+                                   std::string_view author, std::string_view publisher,
+                                   int year, BookStatus st) {
+        if(bookIndex.count(isbn)) return std::nullopt;
+        std::size_t id = books.append(isbn, title, author, publisher, year, st);
+        bookIndex.emplace(books.isbn(id), id);
+        indexForSearch(id, true);
+        ordersStale = true;
+        return bookAt(id);
+    }
+
+    // insertBook for a record loaded from `file`: a lazy catalog keeps only
+    // the ISBN, the status and the offset of `isbn` in the file, which is
+    // where parseBookRecord() reads "ISBN,Title,Author,Publisher,Year" from
+    // (in a checkpoint B line that is after the "B," prefix)
+    std::optional<Book> insertLoadedBook(const MappedFile &file, std::string_view isbn, std::string_view title,
+                                         std::string_view author, std::string_view publisher,
+                                         int year, BookStatus st) {
+        if(!books.isLazy()) return insertBook(isbn, title, author, publisher, year, st);
+        if(bookIndex.count(isbn)) return std::nullopt;
+        std::size_t id = books.appendFromSource(isbn, (std::size_t) (isbn.data() - file.view().data()), st);
+        bookIndex.emplace(books.isbn(id), id);
+        ordersStale = true;
+        return bookAt(id);
+    }
+
+    // Tombstones the book at `it` and drops it from the indexes
+    void eraseBook(std::unordered_map<std::string_view, std::size_t>::iterator it) {
+        std::size_t id = it->second;
+        indexForSearch(id, false);
+        bookIndex.erase(it);
+        books.markRemoved(id);
+        ordersStale = true;
+    }
+
+    void applyBookUpdate(std::size_t id, const BookUpdate &upd) {
+        indexForSearch(id, false);
+        if(upd.title) books.setTitle(id, *upd.title);
+        if(upd.author) books.setAuthor(id, *upd.author);
+        if(upd.publisher) books.setPublisher(id, *upd.publisher);
+        if(upd.year != 0) books.setYear(id, upd.year);
+        indexForSearch(id, true);
+        ordersStale = true;
+    }
+
+    bool insertUser(User *u) {
+        if(!userIndex.emplace(u->getUserIDRef(), u).second) return false;
+        users.push_back(u);
+        userFines.grow(userPool.slotCount());
+        userFines.markDirty(UserPool::slotIndex(u));
+        return true;
+    }
+
+    void clearUsers() {
+        users.clear();
+        userIndex.clear();
+        userPool.clear();
+        userFines.clear();
+        historySpill.open(); // nothing refers to the old blocks any more
+        dueQueue.clear();
+        sweptThrough = -1;
+    }
+
+    // Queues the first threshold of a new loan. Caller holds the user's
+    // lock stripe.
+    void trackLoan(User &u, std::size_t bookId, long long borrowDay) {
+        int maxDays = u.getMaxBorrowDays();
+        if(maxDays <= 0) return;
+        dueQueue.push(DueEntry{(std::int32_t) (borrowDay + maxDays + 1), (std::uint32_t) bookId,
+                               (std::int32_t) borrowDay, LOAN_OVERDUE, &u});
+    }
+
+    // Takes uid's entry off the book's waiting list, and the same
+    // reservation off their account if they still exist. Caller holds the
+    // book's lock stripe and the user's.
+    bool removeFromWaitlist(const Book &b, User *u, std::string_view uid) {
+        std::size_t k = b.waitlist().find(uid);
+        if(k == b.waitlist().size()) return false;
+        long long placed = b.waitlist()[k].day;
+        b.editWaitlist().erase(k);
+        if(u) u->account->dropReservation(b.getISBN(), placed);
+        return true;
+    }
+
+    // Adds a finished borrow to the user's history, moving the older part
+    // of it to the spill file once the in-memory window is full (if that
+    // can't be written, it simply stays in memory). Caller holds the user's
+    // lock stripe.
+    void recordHistory(User &u, std::size_t bookId, long long borrowDay, long long returnDay) {
+        Account &a = *u.account;
+        a.addHistory(HistoryEntry{(std::uint32_t) bookId, (std::int32_t) borrowDay,
+                                  (std::int32_t) returnDay});
+        if(!a.historyOverflowing()) return;
+        long long at = historySpill.write(a.getSpilledTail(), a.spillable(), a.spillableCount());
+        if(at >= 0) a.markSpilled(at, a.spillableCount());
+    }
+
+    // Calls fn(entry) for all of `a`'s history, oldest first
+    template <typename Fn>
+    void forEachHistory(const Account &a, Fn &&fn) {
+        forEachHistory(a.getSpilledTail(), a.getRecentHistory(), fn);
+    }
+
+    // Same for a history given as its spilled chain plus the in-memory
+    // part. Spilled blocks never change once written, so only `recent`
+    // needs the user's lock.
+    template <typename Fn>
+    void forEachHistory(long long spilledTail, const std::vector<HistoryEntry> &recent, Fn &&fn) {
+        std::vector<std::vector<HistoryEntry>> spilled; // newest block first
+        for(long long at = spilledTail; at >= 0; ) {
+            spilled.emplace_back();
+            if(!historySpill.read(at, at, spilled.back())) break;
+        }
+        for(auto it = spilled.rbegin(); it != spilled.rend(); ++it) {
+            for(const auto &e : *it) fn(e);
+        }
+        for(const auto &e : recent) fn(e);
+    }
+
+    // --------------------------------------------------
+    // Report snapshots. Book status and waiting lists (in the catalog) and
+    // fines (here, by pool slot) are kept in copy-on-write pages. A report
+    // takes the catalog lock shared, which checkouts take too, grabs every
+    // stripe just long enough to recopy the pages changed since the last
+    // report, and then formats from that point-in-time view lock-free.
+    // --------------------------------------------------
+    SnapshotPages<double> userFines;
+    std::mutex snapshotMutex; // one refresh at a time
+
+    // Caller holds catalogMutex (shared)
+    SnapshotPages<BookState>::View snapshotBooks() {
+        std::lock_guard<std::mutex> one(snapshotMutex);
+        std::array<std::unique_lock<std::mutex>, kLockStripes> stripes;
+        for(std::size_t k = 0; k < kLockStripes; ++k) stripes[k] = std::unique_lock<std::mutex>(bookLocks[k]);
+        return books.snapshotStates();
+    }
+
+    // Fines by pool slot. Caller holds catalogMutex (shared).
+    SnapshotPages<double>::View snapshotFines() {
+        std::lock_guard<std::mutex> one(snapshotMutex);
+        std::array<std::unique_lock<std::mutex>, kLockStripes> stripes;
+        for(std::size_t k = 0; k < kLockStripes; ++k) stripes[k] = std::unique_lock<std::mutex>(userLocks[k]);
+        return userFines.refresh(userPool.slotCount(), [this](std::size_t slot) {
+            User* u = userPool.userAt(slot);
+            return u ? u->getFine() : 0.0;
+        });
+    }
+
+    // One account, copied under its lock
+    struct AccountSnapshot {
+        double fine;
+        int overdueLoans;
+        std::vector<BorrowInfo> borrows;
+        std::vector<Account::ReservedBook> reserved;
+        std::vector<HistoryEntry> recentHistory;
+        long long spilledTail;
+    };
+
+    // Caller holds catalogMutex (shared)
+    AccountSnapshot snapshotAccount(User &u) {
+        std::lock_guard<std::mutex> userGuard(userLock(u.getUserIDRef()));
+        const Account &a = *u.account;
+        return AccountSnapshot{u.getFine(), a.getOverdueLoans(), a.getCurrentBorrows(),
+                               a.getReservedBooks(), a.getRecentHistory(), a.getSpilledTail()};
+    }
+
+    std::string describeHistory(const HistoryEntry &e) {
+        std::string line = "ISBN: ";
+        line.append(books.isbn(e.bookId));
+        if(e.returnDay != 0) {
+            line.append(", BorrowedDay: ").append(std::to_string(e.borrowDay))
+                .append(", ReturnedDay: ").append(std::to_string(e.returnDay));
+        }
+        return line;
+    }
+
+    // Catalog slot for an ISBN found in saved history. A book removed since
+    // gets a removed slot of its own so the entry can still name it.
+    std::size_t historyBookId(std::string_view isbn) {
+        auto it = bookIndex.find(isbn);
+        if(it != bookIndex.end()) return it->second;
+        std::size_t id = books.append(isbn, "", "", "", 0, BookStatus::AVAILABLE);
+        books.markRemoved(id);
+        ordersStale = true;
+        return id;
+    }
+
+    // --------------------------------------------------
+    // Parallel replay. A record only touches its book and its user's
+    // account, and what it does to the book (status, waiting list) depends
+    // on that book's earlier records alone. So records are shuffled into
+    // partitions by book and each partition is applied in log order; the
+    // account changes this produces are then applied per user, again in log
+    // order. The end state is the same as a serial replay.
+    // --------------------------------------------------
+    static const std::size_t kParallelReplayMinBytes = 1 << 20; // smaller tails replay serially
+
+    struct ReplayRecord {
+        std::uint64_t seq;     // chunk << 40 | index in the chunk, i.e. log order
+        User* user;            // nullptr if the user is gone (cancel only)
+        std::string_view uid;
+        std::uint32_t bookId;
+        TxOp op;
+        long long day;
+    };
+
+    // An account change from replaying a record: borrow/return/reserve as
+    // logged, cancel = drop the reservation placed on `day`
+    struct AccountEffect {
+        std::uint64_t seq;
+        User* user;
+        std::uint32_t bookId;
+        TxOp op;
+        long long day;
+    };
+
+    // Applies the book side of a record; account changes go to
+    // effects[user partition]
+    void replayOnBook(const ReplayRecord &r, std::vector<std::vector<AccountEffect>> &effects) {
+        auto emit = [&](TxOp op, long long day) {
+            std::size_t q = std::hash<std::string_view>()(r.uid) % effects.size();
+            effects[q].push_back(AccountEffect{r.seq, r.user, r.bookId, op, day});
+        };
+        Book b = bookAt(r.bookId);
+        const ReservationQueue &q = b.waitlist();
+        if(r.op == TxOp::BORROW || r.op == TxOp::CANCEL) {
+            // a borrow fulfils the user's reservation, if any
+            std::size_t k = q.find(r.uid);
+            if(k < q.size()) {
+                long long placed = q[k].day;
+                b.editWaitlist().erase(k);
+                if(r.user) emit(TxOp::CANCEL, placed);
+            }
+            if(r.op == TxOp::BORROW) {
+                b.setStatus(BookStatus::BORROWED);
+                emit(TxOp::BORROW, r.day);
+            }
+        }
+        else if(r.op == TxOp::RETURN) {
+            b.setStatus(BookStatus::AVAILABLE);
+            emit(TxOp::RETURN, r.day);
+        }
+        else if(r.op == TxOp::RESERVE) {
+            if(q.find(r.uid) == q.size()) {
+                b.editWaitlist().push(r.uid, r.day);
+                emit(TxOp::RESERVE, r.day);
+            }
+        }
+    }
+
+    void replayOnAccount(const AccountEffect &e) {
+        Account &a = *e.user->account;
+        std::string_view isbn = books.isbn(e.bookId);
+        if(e.op == TxOp::BORROW) {
+            if(a.addBorrowed(isbn, e.day)) trackLoan(*e.user, e.bookId, e.day);
+        }
+        else if(e.op == TxOp::RETURN) {
+            if(auto day = a.takeBorrowed(isbn)) recordHistory(*e.user, e.bookId, *day, e.day);
+        }
+        else if(e.op == TxOp::RESERVE) {
+            a.addReservation(isbn, e.day);
+        }
+        else if(e.op == TxOp::CANCEL) {
+            a.dropReservation(isbn, e.day);
+        }
+    }
+
+    // Returns false if the log is damaged (replayed up to the damage)
+    bool replayParallel(std::string_view data, std::size_t from, std::size_t threads) {
+        // 1. Parse and shuffle. Text logs are cut into line-aligned chunks
+        // parsed side by side; a binary log's dictionaries carry over from
+        // record to record, so it is decoded in one pass.
+        std::vector<std::size_t> cuts = isBinaryLog(data) ? std::vector<std::size_t>{from, data.size()}
+                                                           : splitAtLines(data, from, threads);
+        std::size_t chunks = cuts.size() - 1;
+        // parts[c][p]: chunk c's records for book partition p, in log order
+        std::vector<std::vector<std::vector<ReplayRecord>>> parts(
+            chunks, std::vector<std::vector<ReplayRecord>>(threads));
+        std::vector<char> intact(chunks, 1);
+        runParallel(chunks, [&](std::size_t c) {
+            std::uint64_t seq = (std::uint64_t) c << 40;
+            intact[c] = readTransactionLog(data.substr(0, cuts[c + 1]), cuts[c], [&](const TxRecord &rec) {
+                auto it = bookIndex.find(rec.isbn);
+                if(it == bookIndex.end() || rec.op == TxOp::UNKNOWN) return; // skip bad lines
+                User* u = findUser(rec.uid);
+                if(!u && rec.op != TxOp::CANCEL) return;
+                parts[c][it->second % threads].push_back(
+                    ReplayRecord{seq++, u, rec.uid, (std::uint32_t) it->second, rec.op, rec.day});
+            });
+        });
+
+        // 2. Books, one partition per thread. effects[p][q]: account
+        // changes from book partition p for user partition q.
+        std::vector<std::vector<std::vector<AccountEffect>>> effects(
+            threads, std::vector<std::vector<AccountEffect>>(threads));
+        runParallel(threads, [&](std::size_t p) {
+            for(std::size_t c = 0; c < chunks; ++c) {
+                for(const ReplayRecord &r : parts[c][p]) replayOnBook(r, effects[p]);
+                std::vector<ReplayRecord>().swap(parts[c][p]);
+            }
+        });
+
+        // 3. Accounts, one user partition per thread, merged back into log
+        // order (a borrow's two changes share a seq, hence stable)
+        runParallel(threads, [&](std::size_t q) {
+            std::vector<AccountEffect> mine;
+            for(std::size_t p = 0; p < threads; ++p) {
+                mine.insert(mine.end(), effects[p][q].begin(), effects[p][q].end());
+                std::vector<AccountEffect>().swap(effects[p][q]);
+            }
+            std::stable_sort(mine.begin(), mine.end(), [](const AccountEffect &x, const AccountEffect &y) {
+                return x.seq < y.seq;
+            });
+            for(const AccountEffect &e : mine) replayOnAccount(e);
+        });
+        return std::find(intact.begin(), intact.end(), 0) == intact.end();
+    }
+
+public:
+    Library() { historySpill.open(); }
+
+    
+    void loadBooks(const std::string &filename) {
+        MetricTimer timer(Metric::LOAD_BOOKS);
+        std::unique_ptr<MappedFile> file(new MappedFile(filename));
+        if(!file->is_open()) {
+            std::cerr << "Could not open " << filename << "\n";
+            return;
+        }
+        books.clear();
+        bookIndex.clear();
+        searchIndex.clear();
+        searchStale = books.isLazy();
+        ordersStale = true;
+        std::string_view rest = file->view(), line;
+        while(nextLine(rest, line)) {
+            if(line.empty()) continue;
+            // ISBN,Title,Author,Publisher,Year,Status
+            std::string_view f[6];
+            int y;
+            if(splitFields(line, f, 6) < 5 || !parseNumber(f[4], y)) continue; // skip bad lines
+            // reservedBy isn't stored in the file (can be known while reading through the transactions)
+            insertLoadedBook(*file, f[0], f[1], f[2], f[3], y, stringToBookStatus(f[5])); // first record wins on duplicate ISBN
+        }
+        if(books.isLazy()) books.setSource(std::move(file));
+    }
+
+    void loadUsers(const std::string &filename) {
+        MetricTimer timer(Metric::LOAD_USERS);
+        MappedFile file(filename);
+        if(!file.is_open()) {
+            std::cerr << "Could not open " << filename << "\n";
+            return;
+        }
+        clearUsers();
+        std::string_view rest = file.view(), line;
+        while(nextLine(rest, line)) {
+            if(line.empty()) continue;
+            // userID,password,name,role,fine
+            std::string_view f[5];
+            double fine;
+            if(splitFields(line, f, 5) < 5 || !parseNumber(f[4], fine)) continue;
+            User* uPtr = userPool.make(f[3], std::string(f[0]), std::string(f[1]),
+                                       std::string(f[2]), fine);
+            if(uPtr) {
+                uPtr->setFine(fine);
+                if(!insertUser(uPtr)) userPool.destroy(uPtr); // duplicate userID, keep the first
+            }
+        }
+    }
+
+    // Replays the log starting at byte `fromOffset` (0 = whole history,
+    // a checkpoint's offset = only what happened after it). Long logs are
+    // replayed on up to `threads` threads.
+    void loadTransactions(const std::string &filename, long long fromOffset = 0,
+                          std::size_t threads = 1) {
+        MetricTimer timer(Metric::LOAD_TRANSACTIONS);
+        MappedFile file(filename);
+        if(!file.is_open()) {
+            std::cerr << "Could not open " << filename << "\n";
+            return;
+        }
+        std::size_t from = (std::size_t) std::max(0LL, fromOffset);
+        bool intact;
+        if(threads > 1 && from < file.view().size() &&
+           file.view().size() - from >= kParallelReplayMinBytes) {
+            intact = replayParallel(file.view(), from, threads);
+        } else {
+            intact = readTransactionLog(file.view(), from, [this](const TxRecord &rec) {
+                User* u = findUser(rec.uid);
+                auto b = findBook(rec.isbn);
+                if(b && rec.op == TxOp::CANCEL) {
+                    removeFromWaitlist(*b, u, rec.uid); // the user may be gone by now
+                    return;
+                }
+                if(!u || !b) return; // skip bad lines
+    
+                if(rec.op == TxOp::BORROW) {
+                    b->setStatus(BookStatus::BORROWED);
+                    removeFromWaitlist(*b, u, rec.uid); // the reservation it fulfils, if any
+                    if(u->account->addBorrowed(b->getISBN(), rec.day)) trackLoan(*u, b->getId(), rec.day);
+                }
+                else if(rec.op == TxOp::RETURN) {
+                    if(auto day = u->account->takeBorrowed(rec.isbn)) {
+                        recordHistory(*u, b->getId(), *day, rec.day);
+                    }
+                    b->setStatus(BookStatus::AVAILABLE);
+                }
+                else if(rec.op == TxOp::RESERVE) {
+                    if(b->waitlist().find(rec.uid) == b->waitlist().size()) {
+                        b->editWaitlist().push(rec.uid, rec.day);
+                        u->account->addReservation(b->getISBN(), rec.day);
+                    }
+                }
+            });
+        }
+        if(!intact) std::cerr << "Warning: " << filename << " is damaged; replayed up to the damage.\n";
+    }
+
+    
+    // findUser for callers that don't already hold catalogMutex
+    User* findUserShared(std::string_view uid) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        return findUser(uid);
+    }
+
+    // Checks a login; `user` is set on success. Attempts per userID are
+    // throttled before any hashing happens, repeat logins are answered from
+    // the verification cache, and a plaintext password is replaced by its
+    // hash once it has been verified.
+    OpResult authenticate(const std::string &uid, const std::string &pwd, User* &user) {
+        user = nullptr;
+        if(!loginThrottle.tryAcquire(uid)) {
+            return OpResult::fail(OpStatus::THROTTLED, "Too many failed logins; try again later.");
+        }
+        User* u = findUserShared(uid);
+        std::string stored;
+        if(u) {
+            std::lock_guard<std::mutex> userGuard(userLock(uid));
+            stored = u->getPassword();
+        }
+        bool cached = u && credentialCache.contains(uid, stored, pwd);
+        if(!u || (!cached && !verifyPassword(stored, pwd))) {
+            if(!u || !isPasswordHash(stored)) burnPasswordCheck(pwd);
+            return OpResult::fail(OpStatus::DENIED, "Invalid credentials.");
+        }
+        loginThrottle.reset(uid);
+        if(!isPasswordHash(stored)) {
+            std::string hashed = hashPassword(pwd);
+            std::lock_guard<std::mutex> userGuard(userLock(uid));
+            if(u->getPassword() == stored) {
+                u->setPassword(hashed);
+                markUserDirty(*u);
+                stored = hashed;
+                cached = false;
+            }
+        }
+        if(!cached) credentialCache.insert(uid, stored, pwd);
+        user = u;
+        return OpResult::ok("Welcome " + u->getName() + " (" + std::string(u->getRoleName()) + ")");
+    }
+
+    // Replaces every plaintext password with a hash, on `threads` threads;
+    // returns how many were replaced. Caller makes sure nothing else runs.
+    std::size_t hashPlaintextPasswords(std::size_t threads) {
+        std::vector<User*> todo;
+        for(User* u : users) {
+            if(!isPasswordHash(u->getPassword())) todo.push_back(u);
+        }
+        std::size_t n = std::max<std::size_t>(1, std::min(threads, todo.size()));
+        runParallel(n, [&](std::size_t t) {
+            for(std::size_t k = t; k < todo.size(); k += n) {
+                todo[k]->setPassword(hashPassword(todo[k]->getPassword()));
+            }
+        });
+        for(User* u : todo) markUserDirty(*u);
+        return todo.size();
+    }
+
+    std::optional<Book> findBookShared(std::string_view isbn) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        return findBook(isbn);
+    }
+
+    User* findUser(std::string_view uid) {
+        MetricTimer timer(Metric::FIND_USER, kLookupSampleEvery);
+        auto it = userIndex.find(uid);
+        return (it == userIndex.end()) ? nullptr : it->second;
+    }
+
+    std::optional<Book> findBook(std::string_view isbn) {
+        MetricTimer timer(Metric::FIND_BOOK, kLookupSampleEvery);
+        auto it = bookIndex.find(isbn);
+        if(it == bookIndex.end()) return std::nullopt;
+        return bookAt(it->second);
+    }
+
+    // books in the catalog, not counting removed ones
+    std::size_t bookCount() const { return bookIndex.size(); }
+
+    bool openTransactionLog(const std::string &filename,
+                            const LogDurability &durability = LogDurability(),
+                            LogFormat newFormat = LogFormat::TEXT) {
+        if(!txLog.open(filename, durability, newFormat)) {
+            std::cerr << "Cannot open " << filename << " for append.\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Makes every appended transaction visible in the log file
+    void flushTransactions() { txLog.flush(); }
+
+    void closeTransactionLog() { txLog.close(); }
+
+    void appendTransaction(const std::string &uid,
+                           const std::string &isbn,
+                           TxOp op) {
+        MetricTimer timer(Metric::APPEND_TRANSACTION);
+        if(!txLog.is_open()) {
+            std::cerr << "Transaction log is not open.\n";
+            return;
+        }
+        txLog.append(uid, isbn, op, currentDaysSinceEpoch()); // failures go to stderr; records are retried
+    }
+
+    
+    // Flags the loans that crossed a threshold since the last sweep: past
+    // due, and for faculty 60 days past due (which blocks borrowing).
+    // Cheap when it already ran today. Caller holds catalogMutex (shared is
+    // enough) and no book or user locks.
+    void sweepOverdue() {
+        long long today = currentDaysSinceEpoch();
+        if(sweptThrough.load() >= today) return;
+        std::lock_guard<std::mutex> sweep(sweepMutex);
+        if(sweptThrough.load() >= today) return;
+        std::vector<DueEntry> due;
+        // crossing one threshold can queue the next, possibly already due
+        for(dueQueue.popDue(today, due); !due.empty(); dueQueue.popDue(today, due)) {
+            std::vector<DueEntry> batch;
+            batch.swap(due);
+            for(const DueEntry &e : batch) {
+                if(!UserPool::isLive(e.user)) continue;
+                User &u = *e.user;
+                std::lock_guard<std::mutex> userGuard(userLock(u.getUserIDRef()));
+                if(!u.account->markLoanStage(books.isbn(e.bookId), e.borrowDay, e.stage)) continue;
+                int blockAfter = u.policy().blockAfterOverdueDays;
+                if(e.stage == LOAN_OVERDUE && blockAfter > 0) {
+                    dueQueue.push(DueEntry{e.fireDay + blockAfter, e.bookId, e.borrowDay, LOAN_BLOCKING, e.user});
+                }
+            }
+        }
+        sweptThrough = today;
+    }
+
+    // Rules shared by borrowing and reserving; caller holds the user's lock
+    bool checkCanBorrow(User &user, const std::string &isbn, OpResult &res) {
+        // Check if user is already borrowing
+        if(user.account->isBorrowing(isbn)) {
+            res = OpResult::fail(OpStatus::DENIED, "You are already borrowing this book; can't borrow/reserve it.");
+            return false;
+        }
+        const RolePolicy &policy = user.policy();
+        // Librarian can't borrow
+        if(!policy.canBorrow) {
+            res = OpResult::fail(OpStatus::DENIED, std::string(policy.name) + " cannot borrow.");
+            return false;
+        }
+        // Students must pay fines first
+        if(policy.finesBlockBorrowing && user.getFine() > 0.0) {
+            res = OpResult::fail(OpStatus::DENIED, "You have unpaid fines; pay first.");
+            return false;
+        }
+        // Check limit: borrowed+reserved should be less than max allowed
+        int reservations = user.account->activeReservations(currentDaysSinceEpoch());
+        if(user.account->borrowedCount() + reservations >= policy.maxBooks) {
+            res = OpResult::fail(OpStatus::DENIED, "You reached max books allowed.");
+            return false;
+        }
+        // Faculty: a loan long overdue blocks borrowing (kept up to date by sweepOverdue)
+        if(policy.blockAfterOverdueDays > 0 && user.account->hasBlockingLoan()) {
+            res = OpResult::fail(OpStatus::DENIED, "Cannot borrow; you have a book overdue > " +
+                                 std::to_string(policy.blockAfterOverdueDays) + " days.");
+            return false;
+        }
+        return true;
+    }
+
+    // --------------------------------------------------
+    // Borrow / reserve / return without any console I/O, safe to call from
+    // several threads. Lock order: catalog (shared) -> book stripe -> user
+    // stripe(s); users are never held while waiting for a book.
+    // --------------------------------------------------
+    OpResult tryBorrow(User &user, const std::string &isbn) {
+        MetricTimer timer(Metric::BORROW);
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        sweepOverdue();
+        auto b = findBook(isbn);
+        std::unique_lock<std::mutex> bookGuard;
+        if(b) bookGuard = std::unique_lock<std::mutex>(bookLock(isbn));
+        std::lock_guard<std::mutex> userGuard(userLock(user.getUserIDRef()));
+
+        OpResult res;
+        if(!checkCanBorrow(user, isbn, res)) return res;
+        if(!b) return OpResult::fail(OpStatus::NOT_FOUND, "Book not found.");
+
+        // If someone else is borrowing it, offer reservation
+        if(b->getStatus() == BookStatus::BORROWED) {
+            const ReservationQueue &q = b->waitlist();
+            std::size_t k = q.find(user.getUserIDRef());
+            if(k < q.size()) {
+                return OpResult::fail(OpStatus::DENIED, "This book is already borrowed by someone else.\n"
+                                      "You already reserved it (position " + std::to_string(k + 1) + ").");
+            }
+            std::string msg = "This book is already borrowed by someone else.";
+            if(!q.empty()) msg += "\n" + std::to_string(q.size()) + " reservation(s) ahead of you.";
+            return OpResult::fail(OpStatus::RESERVABLE, msg);
+        }
+
+        // Otherwise it's available => borrow now
+        b->setStatus(BookStatus::BORROWED);
+        long long today = currentDaysSinceEpoch();
+        if(user.account->addBorrowed(isbn, today)) trackLoan(user, b->getId(), today);
+        appendTransaction(user.getUserID(), isbn, TxOp::BORROW);
+        return OpResult::ok("Book borrowed successfully.");
+    }
+
+    OpResult tryReserve(User &user, const std::string &isbn) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        sweepOverdue();
+        auto b = findBook(isbn);
+        std::unique_lock<std::mutex> bookGuard;
+        if(b) bookGuard = std::unique_lock<std::mutex>(bookLock(isbn));
+        std::lock_guard<std::mutex> userGuard(userLock(user.getUserIDRef()));
+
+        OpResult res;
+        if(!checkCanBorrow(user, isbn, res)) return res;
+        if(!b) return OpResult::fail(OpStatus::NOT_FOUND, "Book not found.");
+        if(b->getStatus() != BookStatus::BORROWED) {
+            return OpResult::fail(OpStatus::INVALID, "This book is available; borrow it instead.");
+        }
+        const ReservationQueue &q = b->waitlist();
+        long long today = currentDaysSinceEpoch();
+        std::size_t k = q.find(user.getUserIDRef());
+        if(k < q.size()) {
+            if(!reservationExpired(q[k].day, today)) {
+                return OpResult::fail(OpStatus::DENIED, "You already reserved this book (position " +
+                                      std::to_string(k + 1) + ").");
+            }
+            // a lapsed one: replace it with a new reservation at the back
+            removeFromWaitlist(*b, &user, user.getUserIDRef());
+            appendTransaction(user.getUserID(), isbn, TxOp::CANCEL);
+        }
+        b->editWaitlist().push(user.getUserIDRef(), today);
+        user.account->addReservation(isbn, today);
+        appendTransaction(user.getUserID(), isbn, TxOp::RESERVE);
+        return OpResult::ok("Book reserved successfully. Position in queue: " + std::to_string(q.size()));
+    }
+
+    OpResult tryReturn(User &user, const std::string &isbn) {
+        MetricTimer timer(Metric::RETURN);
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        auto b = findBook(isbn);
+        std::unique_lock<std::mutex> bookGuard;
+        if(b) bookGuard = std::unique_lock<std::mutex>(bookLock(isbn));
+
+        // Next in line: the first reservation that hasn't lapsed and whose
+        // user still exists; the `skipped` ones before it get dropped. That
+        // user's account changes too, so lock both users together.
+        long long today = currentDaysSinceEpoch();
+        User* reservedUser = nullptr;
+        std::size_t skipped = 0;
+        if(b) {
+            const ReservationQueue &q = b->waitlist();
+            for(; skipped < q.size(); ++skipped) {
+                if(reservationExpired(q[skipped].day, today) || q[skipped].uid == user.getUserIDRef()) continue;
+                reservedUser = findUser(q[skipped].uid);
+                if(reservedUser) break;
+            }
+        }
+        std::mutex &m1 = userLock(user.getUserIDRef());
+        std::mutex &m2 = reservedUser ? userLock(reservedUser->getUserIDRef()) : m1;
+        std::unique_lock<std::mutex> userGuard1(m1, std::defer_lock), userGuard2(m2, std::defer_lock);
+        if(&m1 == &m2) userGuard1.lock();
+        else std::lock(userGuard1, userGuard2);
+
+        const RolePolicy &policy = user.policy();
+        if(!policy.canBorrow) {
+            return OpResult::fail(OpStatus::DENIED, std::string(policy.name) + " doesn't borrow books.");
+        }
+        // Must actually be borrowing; this also removes it from the
+        // user's borrowed list
+        std::optional<long long> dayStamp = user.account->takeBorrowed(isbn);
+        if(!dayStamp) {
+            return OpResult::fail(OpStatus::DENIED, "You are not borrowing this book.");
+        }
+
+        OpResult res = OpResult::ok("");
+        // Overdue check
+        long long overdueDays = today - *dayStamp - policy.maxDays;
+        double addedFine = (overdueDays > 0) ? policy.fineFor(overdueDays) : 0.0;
+        if(addedFine > 0.0) {
+            user.setFine(user.getFine() + addedFine);
+            markUserDirty(user);
+            res.addLine("Book overdue by " + std::to_string(overdueDays) +
+                        " days. Fine added: " + formatAmount(addedFine));
+        } else if(overdueDays > 0) {
+            std::string who(policy.name);
+            std::transform(who.begin(), who.end(), who.begin(), [](unsigned char c) { return (char) std::tolower(c); });
+            res.addLine("Returned " + std::to_string(overdueDays) +
+                        " days late. (No fine for " + who + ")");
+        }
+
+        if(!b) {
+            // Should never happen if user had it, but just in case
+            res.status = OpStatus::NOT_FOUND;
+            res.addLine("Book not found in library list.");
+            return res;
+        }
+        recordHistory(user, b->getId(), *dayStamp, today);
+
+        // Step 1: Append the "return" transaction now
+        // so that the transaction log sees them returning
+        appendTransaction(user.getUserID(), isbn, TxOp::RETURN);
+
+        // Step 2: Set the book to AVAILABLE in memory first
+        b->setStatus(BookStatus::AVAILABLE);
+
+        // Step 3: Drop lapsed reservations and ones whose user is gone
+        ReservationQueue &q = b->editWaitlist(); // the status changed anyway
+        for(std::size_t k = 0; k < skipped; ++k) {
+            if(q[0].uid == user.getUserIDRef()) user.account->dropReservation(isbn, q[0].day);
+            appendTransaction(q[0].uid, isbn, TxOp::CANCEL);
+            q.pop();
+        }
+
+        // Step 4: If someone is still waiting, give it to them immediately
+        if(reservedUser) {
+            std::string reservedUID = q[0].uid;
+            reservedUser->account->dropReservation(isbn, q[0].day);
+            q.pop();
+
+            // set it borrowed by that user
+            b->setStatus(BookStatus::BORROWED);
+            if(reservedUser->account->addBorrowed(isbn, today)) trackLoan(*reservedUser, b->getId(), today);
+
+            // record the auto-borrow in transactions
+            appendTransaction(reservedUID, isbn, TxOp::BORROW);
+
+            res.addLine("Book auto-borrowed by reserved user: " + reservedUID);
+        }
+        // else if no reservation, remain AVAILABLE
+
+        res.addLine("Book returned successfully.");
+        return res;
+    }
+
+    void borrowBook(User &user, const std::string &isbn) {
+        OpResult res = tryBorrow(user, isbn);
+        std::cout << res.message;
+        if(res.status == OpStatus::RESERVABLE) {
+            std::cout << "Do you want to reserve it? (y/n): ";
+            char c;
+            std::cin >> c;
+            if(c=='y' || c=='Y') {
+                std::cout << tryReserve(user, isbn).message;
+            }
+        }
+    }
+
+    void returnBook(User &user, const std::string &isbn) {
+        std::cout << tryReturn(user, isbn).message;
+    }
+
+    OpResult cancelReservation(User &user, const std::string &isbn) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        auto b = findBook(isbn);
+        if(!b) return OpResult::fail(OpStatus::NOT_FOUND, "Book not found.");
+        std::lock_guard<std::mutex> bookGuard(bookLock(isbn));
+        std::lock_guard<std::mutex> userGuard(userLock(user.getUserIDRef()));
+        if(!removeFromWaitlist(*b, &user, user.getUserIDRef())) {
+            return OpResult::fail(OpStatus::DENIED, "You have no reservation for this book.");
+        }
+        appendTransaction(user.getUserID(), isbn, TxOp::CANCEL);
+        return OpResult::ok("Reservation cancelled.");
+    }
+
+    // "ISBN, ReservedDay: d, Position: k of n" per reservation of `user`
+    void describeReservations(std::string &out, User &user) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        std::vector<std::string> isbns;
+        {
+            std::lock_guard<std::mutex> userGuard(userLock(user.getUserIDRef()));
+            for(const auto &r : user.account->getReservedBooks()) isbns.push_back(r.isbn);
+        }
+        // positions need the book locks, which come before user locks
+        for(const auto &isbn : isbns) {
+            auto b = findBook(isbn);
+            if(!b) continue;
+            std::lock_guard<std::mutex> bookGuard(bookLock(isbn));
+            const ReservationQueue &q = b->waitlist();
+            std::size_t k = q.find(user.getUserIDRef());
+            if(k == q.size()) continue; // cancelled meanwhile
+            out.append(isbn).append(", ReservedDay: ").append(std::to_string(q[k].day))
+               .append(", Position: ").append(std::to_string(k + 1))
+               .append(" of ").append(std::to_string(q.size()))
+               .append(reservationExpired(q[k].day, currentDaysSinceEpoch()) ? " (lapsed)" : "")
+               .append("\n");
+        }
+    }
+
+    void manageReservations(User &user) {
+        std::string list;
+        describeReservations(list, user);
+        std::cout << "Reservations:\n";
+        if(list.empty()) {
+            std::cout << "  None\n";
+            return;
+        }
+        std::string_view rest = list, line;
+        while(nextLine(rest, line)) std::cout << "  " << line << "\n";
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string isbn;
+        std::cout << "ISBN to cancel (empty = back): ";
+        std::getline(std::cin, isbn);
+        if(!isbn.empty()) std::cout << cancelReservation(user, isbn).message << "\n";
+    }
+
+    // Formats one book as a books.txt style line plus its waiting list
+    // (user ids separated by ';', next in line first)
+    void describeBook(std::string &out, std::string_view isbn, const BookMeta &m, BookStatus st,
+                      const ReservationQueue &waiting) {
+        out.append(isbn).append(",").append(m.title).append(",")
+           .append(m.author).append(",").append(m.publisher).append(",")
+           .append(std::to_string(m.year)).append(",").append(bookStatusToString(st))
+           .append(",").append(waiting.holders(";")).append("\n");
+    }
+
+    // caller holds the book's lock stripe
+    void describeBook(std::string &out, const Book &b) {
+        describeBook(out, b.getISBN(), b.getMeta(), b.getStatus(), b.waitlist());
+    }
+
+    // Thread-safe lookups for the server front end
+    bool describeBook(std::string &out, const std::string &isbn) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        auto b = findBook(isbn);
+        if(!b) return false;
+        std::lock_guard<std::mutex> bookGuard(bookLock(isbn));
+        describeBook(out, *b);
+        return true;
+    }
+
+    void describeAllBooks(std::string &out) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        auto states = snapshotBooks();
+        BookCatalog::Scan scan(books);
+        for(std::size_t id = 0; id < books.size(); ++id) {
+            const BookState &st = SnapshotPages<BookState>::at(states, id);
+            if(st.removed) continue;
+            describeBook(out, books.isbn(id), scan.meta(id), st.status, st.waitlist);
+        }
+    }
+
+    void describeAccount(std::string &out, User &user) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        AccountSnapshot a = snapshotAccount(user);
+        out.append("Fine: ").append(formatAmount(a.fine)).append("\n");
+        for(const auto &bi : a.borrows) {
+            out.append("Borrowed: ").append(bi.ISBN).append(", BorrowedDay: ")
+               .append(std::to_string(bi.borrowDay)).append("\n");
+        }
+        for(const auto &r : a.reserved) {
+            out.append("Reserved: ").append(r.isbn).append(", ReservedDay: ")
+               .append(std::to_string(r.day)).append("\n");
+        }
+        forEachHistory(a.spilledTail, a.recentHistory, [&](const HistoryEntry &e) {
+            out.append("History: ").append(books.isbn(e.bookId)).append("\n");
+        });
+    }
+
+    // --------------------------------------------------
+    // Catalog/user management without console I/O (used by the menu
+    // wrappers below and by batch mode)
+    // --------------------------------------------------
+    static constexpr const char* kUnstorableField = "Fields can't contain commas or line breaks.";
+
+    OpResult addBook(const std::string &isbn, const std::string &title,
+                     const std::string &author, const std::string &publisher, int year) {
+        if(isbn.empty()) return OpResult::fail(OpStatus::INVALID, "ISBN is required.");
+        for(const std::string *f : {&isbn, &title, &author, &publisher}) {
+            if(!isStorableField(*f)) return OpResult::fail(OpStatus::INVALID, kUnstorableField);
+        }
+        std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+        if(!insertBook(isbn, title, author, publisher, year, BookStatus::AVAILABLE)) {
+            return OpResult::fail(OpStatus::DENIED, "Book with this ISBN already exists!");
+        }
+        markBookDirty(isbn);
+        return OpResult::ok("Book added.");
+    }
+
+    OpResult removeBook(const std::string &isbn) {
+        std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+        auto it = bookIndex.find(isbn);
+        if(it == bookIndex.end()) return OpResult::fail(OpStatus::NOT_FOUND, "No such book.");
+        if(books.status(it->second) == BookStatus::BORROWED) {
+            return OpResult::fail(OpStatus::DENIED, "Cannot remove a borrowed book.");
+        }
+        eraseBook(it);
+        markBookDirty(isbn);
+        return OpResult::ok("Book removed.");
+    }
+
+    OpResult updateBook(const std::string &isbn, const BookUpdate &upd) {
+        for(const auto *f : {&upd.title, &upd.author, &upd.publisher}) {
+            if(*f && !isStorableField(**f)) return OpResult::fail(OpStatus::INVALID, kUnstorableField);
+        }
+        std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+        auto it = bookIndex.find(isbn);
+        if(it == bookIndex.end()) return OpResult::fail(OpStatus::NOT_FOUND, "No such book.");
+        applyBookUpdate(it->second, upd);
+        markBookDirty(isbn);
+        return OpResult::ok("Book updated.");
+    }
+
+    OpResult addUser(const std::string &uid, const std::string &pwd,
+                     const std::string &nm, const std::string &rl) {
+        if(uid.empty()) return OpResult::fail(OpStatus::INVALID, "userID is required.");
+        if(!isStorableField(uid) || !isStorableField(nm)) return OpResult::fail(OpStatus::INVALID, kUnstorableField);
+        std::string hashed = hashPassword(pwd); // before the lock, it takes a while
+        std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+        User* uPtr = userPool.make(rl, uid, hashed, nm);
+        if(!uPtr) return OpResult::fail(OpStatus::INVALID, "Invalid role.");
+        if(!insertUser(uPtr)) {
+            userPool.destroy(uPtr);
+            return OpResult::fail(OpStatus::DENIED, "User with this ID already exists.");
+        }
+        markUserDirty(*uPtr);
+        return OpResult::ok("User added.");
+    }
+
+    OpResult removeUser(const std::string &uid) {
+        std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+        User* u = findUser(uid);
+        if(!u) return OpResult::fail(OpStatus::NOT_FOUND, "No such user.");
+        if(u->account->borrowedCount() > 0) {
+            return OpResult::fail(OpStatus::DENIED, "Cannot remove user who still borrows a book.");
+        }
+        markUserDirty(*u);
+        for(const auto &r : u->account->getReservedBooks()) {
+            auto it = bookIndex.find(r.isbn);
+            if(it == bookIndex.end()) continue;
+            std::size_t k = books.waitlist(it->second).find(uid);
+            if(k == books.waitlist(it->second).size()) continue;
+            books.editWaitlist(it->second).erase(k);
+            appendTransaction(uid, r.isbn, TxOp::CANCEL);
+        }
+        userIndex.erase(u->getUserIDRef());
+        users.erase(std::find(users.begin(), users.end(), u));
+        userPool.destroy(u);
+        return OpResult::ok("User removed.");
+    }
+
+    OpResult payFine(User &user, double amount) {
+        std::lock_guard<std::mutex> userGuard(userLock(user.getUserIDRef()));
+        if(amount < 0) return OpResult::fail(OpStatus::INVALID, "Amount must not be negative.");
+        bool cleared = user.applyPayment(amount);
+        markUserDirty(user);
+        if(cleared) return OpResult::ok("Fine cleared!");
+        return OpResult::ok("Partial payment done. Remaining fine: " + formatAmount(user.getFine()));
+    }
+
+    void addBook() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string i,t,a,p;
+        int y;
+        std::cout << "Enter ISBN: ";
+        std::getline(std::cin, i);
+        if(findBookShared(i)) {
+            std::cout << "Book with this ISBN already exists!\n";
+            return;
+        }
+        std::cout << "Enter Title: ";
+        std::getline(std::cin, t);
+        std::cout << "Enter Author: ";
+        std::getline(std::cin, a);
+        std::cout << "Enter Publisher: ";
+        std::getline(std::cin, p);
+        std::cout << "Enter Year: ";
+        std::cin >> y;
+        std::cout << addBook(i, t, a, p, y).message;
+    }
+
+    void removeBook() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string isbn;
+        std::cout << "Enter ISBN to remove: ";
+        std::getline(std::cin, isbn);
+        std::cout << removeBook(isbn).message;
+    }
+
+    void updateBook() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string isbn;
+        std::cout << "Enter ISBN to update: ";
+        std::getline(std::cin, isbn);
+        if(!findBookShared(isbn)) {
+            std::cout << "No such book.\n";
+            return;
+        }
+        std::string newTitle, newAuthor, newPub;
+        BookUpdate upd;
+        std::cout << "Enter new Title (or . to skip): ";
+        std::getline(std::cin, newTitle);
+        if(newTitle != ".") upd.title = newTitle;
+
+        std::cout << "Enter new Author (or . to skip): ";
+        std::getline(std::cin, newAuthor);
+        if(newAuthor != ".") upd.author = newAuthor;
+
+        std::cout << "Enter new Publisher (or . to skip): ";
+        std::getline(std::cin, newPub);
+        if(newPub != ".") upd.publisher = newPub;
+
+        std::cout << "Enter new Year (or 0 to skip): ";
+        std::cin >> upd.year;
+        std::cout << updateBook(isbn, upd).message;
+    }
+
+    void addUser() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string uid, pwd, nm, rl;
+        std::cout << "Enter userID: ";
+        std::getline(std::cin, uid);
+        if(findUserShared(uid)) {
+            std::cout << "User with this ID already exists.\n";
+            return;
+        }
+        std::cout << "Enter password: ";
+        std::getline(std::cin, pwd);
+        std::cout << "Enter name: ";
+        std::getline(std::cin, nm);
+        std::cout << "Enter role (Student/Faculty/Librarian): ";
+        std::getline(std::cin, rl);
+        std::cout << addUser(uid, pwd, nm, rl).message;
+    }
+
+    void removeUser() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string uid;
+        std::cout << "Enter userID to remove: ";
+        std::getline(std::cin, uid);
+        std::cout << removeUser(uid).message;
+    }
+
+    // Best matches for `query` as describeBook lines; returns how many
+    std::size_t searchBooks(std::string &out, std::string_view query, std::size_t limit) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        ensureSearchIndex();
+        auto hits = searchIndex.search(query, limit);
+        for(const auto &h : hits) {
+            std::lock_guard<std::mutex> bookGuard(bookLock(books.isbn(h.id)));
+            describeBook(out, bookAt(h.id));
+        }
+        return hits.size();
+    }
+
+    void searchBooks() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string query;
+        std::cout << "Search title/author/publisher: ";
+        std::getline(std::cin, query);
+        std::string results;
+        std::size_t n = searchBooks(results, query, 20);
+        std::cout << "\n----- Search Results (" << n << ") -----\n";
+        std::string_view rest(results), line;
+        while(nextLine(rest, line)) {
+            // ISBN,Title,Author,Publisher,Year,Status,Waiting list
+            std::string_view f[7];
+            splitFields(line, f, 7);
+            std::cout << f[0] << " | " << f[1] << " | " << f[2] << " | " << f[3]
+                      << " | " << f[4] << " | " << f[5] << "\n";
+        }
+        std::cout << "---------------------\n";
+    }
+
+    static void writeBook(OutputBuffer &out, std::string_view isbn, const BookMeta &m, BookStatus st,
+                          const ReservationQueue &waiting) {
+        out << "ISBN: " << isbn
+            << "\nTitle: " << m.title
+            << "\nAuthor: " << m.author
+            << "\nPublisher: " << m.publisher
+            << "\nYear: " << m.year
+            << "\nStatus: " << bookStatusToString(st)
+            << "\nReservedBy: "
+            << (waiting.empty() ? std::string("None") : waiting.holders(", "))
+            << "\n\n";
+    }
+
+    // caller holds the book's lock stripe
+    static void writeBook(OutputBuffer &out, const Book &b) {
+        writeBook(out, b.getISBN(), b.getMeta(), b.getStatus(), b.waitlist());
+    }
+
+    // One page of books matching `filter` in `sort` order, starting at `cursor`
+    BookPage listBooks(const BookFilter &filter, BookSort sort, std::size_t cursor,
+                       std::size_t pageSize, OutputBuffer &out) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        const std::vector<std::size_t>* ord = nullptr;
+        std::size_t pos = cursor;
+        if(sort != BookSort::CATALOG) {
+            ensureOrders(); // nobody can invalidate them while we hold the shared lock
+            std::size_t k = (std::size_t) sort - 1;
+            ord = &orders[k];
+            if(cursor > 0) pos = (cursor - 1 < orderRank[k].size()) ? orderRank[k][cursor - 1] + 1 : books.size();
+        }
+
+        // authors are interned, so match the name once per distinct author
+        // and compare ids during the scan (names, for lazily loaded books)
+        BookCatalog::Scan scan(books);
+        std::vector<bool> authorOk;
+        if(!filter.author.empty()) {
+            const StringInterner &names = books.authorNames();
+            authorOk.resize(names.size());
+            for(std::uint32_t a = 0; a < names.size(); ++a) {
+                authorOk[a] = equalsIgnoreCase(names.get(a), filter.author);
+            }
+        }
+
+        BookPage page;
+        for(; pos < books.size(); ++pos) {
+            std::size_t id = ord ? (*ord)[pos] : pos;
+            BookMeta m = scan.meta(id);
+            if(m.year < filter.yearFrom || m.year > filter.yearTo) continue;
+            if(!filter.author.empty() && !(books.isResident(id) ? authorOk[books.authorId(id)]
+                                                                : equalsIgnoreCase(m.author, filter.author))) continue;
+            std::lock_guard<std::mutex> bookGuard(bookLock(books.isbn(id)));
+            if(books.isRemoved(id)) continue; // shares a byte with the status
+            if(filter.status && books.status(id) != *filter.status) continue;
+            if(page.ids.size() == pageSize) {
+                // one more match exists, so a next page won't come back empty
+                page.nextCursor = page.ids.back() + 1;
+                break;
+            }
+            page.ids.push_back(id);
+            writeBook(out, bookAt(id));
+        }
+        return page;
+    }
+
+    void browseBooks() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        BookFilter filter;
+        std::string line;
+        std::cout << "Status (a=any, v=available, b=borrowed): ";
+        std::getline(std::cin, line);
+        if(line == "v") filter.status = BookStatus::AVAILABLE;
+        else if(line == "b") filter.status = BookStatus::BORROWED;
+        std::cout << "Author (empty = any): ";
+        std::getline(std::cin, filter.author);
+        std::cout << "Year range from-to (empty = any): ";
+        std::getline(std::cin, line);
+        std::string_view range[2] = {line, line};
+        std::size_t dash = line.find('-');
+        if(dash != std::string::npos) {
+            range[0] = std::string_view(line).substr(0, dash);
+            range[1] = std::string_view(line).substr(dash + 1);
+        }
+        if(!range[0].empty()) parseNumber(range[0], filter.yearFrom);
+        if(!range[1].empty()) parseNumber(range[1], filter.yearTo);
+        std::cout << "Sort by (c=catalog, i=ISBN, t=title, a=author, y=year): ";
+        std::getline(std::cin, line);
+        BookSort sort = BookSort::CATALOG;
+        if(line == "i") sort = BookSort::ISBN;
+        else if(line == "t") sort = BookSort::TITLE;
+        else if(line == "a") sort = BookSort::AUTHOR;
+        else if(line == "y") sort = BookSort::YEAR;
+
+        std::size_t cursor = 0;
+        for(int pageNo = 1; ; ++pageNo) {
+            BookPage page;
+            {
+                OutputBuffer out(std::cout);
+                out << "\n----- Books, page " << pageNo << " -----\n";
+                page = listBooks(filter, sort, cursor, 10, out);
+                if(page.ids.empty()) out << "No books.\n";
+                out << "---------------------\n";
+            }
+            if(page.nextCursor == 0) break;
+            std::cout << "n = next page, anything else = back: ";
+            std::getline(std::cin, line);
+            if(line != "n") break;
+            cursor = page.nextCursor;
+        }
+    }
+
+    void showAllBooks() {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        auto states = snapshotBooks();
+        BookCatalog::Scan scan(books);
+        OutputBuffer out(std::cout);
+        out << "\n----- All Books -----\n";
+        for(std::size_t id = 0; id < books.size(); ++id) {
+            const BookState &st = SnapshotPages<BookState>::at(states, id);
+            if(st.removed) continue;
+            writeBook(out, books.isbn(id), scan.meta(id), st.status, st.waitlist);
+        }
+        out << "---------------------\n";
+    }
+
+    void showMetrics() {
+        std::cout << "\n----- Metrics (since startup) -----\n";
+        Metrics::instance().writeTable(std::cout);
+        std::cout << "(lookups are timed on one call in " << kLookupSampleEvery << ")\n";
+        if(books.isLazy()) {
+            const MetadataCache &c = books.metadataCache();
+            std::cout << "Book metadata cache: " << c.hits() << " hits, " << c.misses()
+                      << " misses, " << c.capacity() << " records max\n";
+        }
+        if(txLog.failures() > 0) {
+            std::cout << "Transaction log: " << txLog.failures() << " failed flushes\n";
+        }
+        std::cout << "---------------------\n";
+    }
+
+    // Before loading: keep book metadata in the files, caching `cacheRecords`
+    void setLazyMetadata(std::size_t cacheRecords) { books.setLazy(cacheRecords); }
+
+    void showAllUsers() {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        auto fines = snapshotFines();
+        OutputBuffer out(std::cout);
+        out << "\n----- All Users -----\n";
+        for(auto *u : users) {
+            out << "UserID: " << u->getUserIDRef()
+                << ", Name: " << u->getName()
+                << ", Role: " << u->getRoleName()
+                << ", Fine: " << SnapshotPages<double>::at(fines, UserPool::slotIndex(u))
+                << "\n";
+        }
+        out << "---------------------\n";
+    }
+
+    void showUserAccount() {
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string uid;
+        std::cout << "Enter userID: ";
+        std::getline(std::cin, uid);
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        User* u = findUser(uid);
+        if(!u) {
+            std::cout << "No such user.\n";
+            return;
+        }
+        sweepOverdue();
+        AccountSnapshot a = snapshotAccount(*u);
+        std::cout << "User: " << u->getName() << " ("
+                  << u->getRoleName() << "), Fine: " << a.fine
+                  << ", Overdue loans: " << a.overdueLoans << "\n";
+        std::cout << "Currently Borrowed:\n";
+        for(const auto &bi : a.borrows) {
+            std::cout << "  ISBN: " << bi.ISBN 
+                      << ", BorrowedDay: " << bi.borrowDay << "\n";
+        }
+        std::cout << "History:\n";
+        forEachHistory(a.spilledTail, a.recentHistory, [&](const HistoryEntry &e) {
+            std::cout << "  " << describeHistory(e) << "\n";
+        });
+    }
+
+    // The user's own history, newest first: the in-memory part, then one
+    // spilled block at a time on request
+    void showHistory(User &user) {
+        const Account &a = *user.account;
+        std::cout << "History (" << a.historySize() << " entries, newest first):\n";
+        if(a.historySize() == 0) {
+            std::cout << "  No History\n";
+            return;
+        }
+        const auto &recent = a.getRecentHistory();
+        for(auto it = recent.rbegin(); it != recent.rend(); ++it) {
+            std::cout << "  " << describeHistory(*it) << "\n";
+        }
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::vector<HistoryEntry> block;
+        for(long long at = a.getSpilledTail(); at >= 0; ) {
+            std::string line;
+            std::cout << "m = older entries, anything else = back: ";
+            std::getline(std::cin, line);
+            if(line != "m" || !historySpill.read(at, at, block)) break;
+            for(auto it = block.rbegin(); it != block.rend(); ++it) {
+                std::cout << "  " << describeHistory(*it) << "\n";
+            }
+        }
+    }
+
+    // --------------------------------------------------
+    // Checkpoint: the full in-memory state (books with their reservation,
+    // users with fines, loans and history) plus the byte offset into the
+    // transaction log it reflects. Startup loads it and replays only the log
+    // written after that offset.
+    //
+    //   LIBRARY-CHECKPOINT 1
+    //   log,<offset>,<hash of the bytes before offset>
+    //   B,ISBN,Title,Author,Publisher,Year,Status,uid:day;uid:day (waiting list)
+    //   U,userID,password,name,role,fine,reservations
+    //   L,userID,ISBN,borrowDay
+    //   H,userID,ISBN,borrowDay,returnDay
+    // --------------------------------------------------
+    bool saveCheckpoint(const std::string &filename, const std::string &logFilename) {
+        MetricTimer timer(Metric::SAVE_CHECKPOINT);
+        long long offset = txLog.is_open() ? txLog.checkpointOffset()
+                                           : std::max(0LL, fileSize(logFilename));
+        if(offset < 0) {
+            std::cerr << "Not writing " << filename << ": the transaction log is behind.\n";
+            return false;
+        }
+        std::string tmpName = filename + ".tmp";
+        std::ofstream fout(tmpName);
+        if(!fout.is_open()) {
+            std::cerr << "Could not open " << tmpName << "\n";
+            return false;
+        }
+        fout << "LIBRARY-CHECKPOINT 1\n"
+             << "log," << offset << "," << logTailHash(logFilename, offset) << "\n";
+        BookCatalog::Scan scan(books);
+        for(std::size_t id = 0; id < books.size(); ++id) {
+            if(books.isRemoved(id)) continue;
+            BookMeta m = scan.meta(id);
+            fout << "B," << books.isbn(id) << ","
+                 << m.title << ","
+                 << m.author << ","
+                 << m.publisher << ","
+                 << m.year << ","
+                 << bookStatusToString(books.status(id)) << ","
+                 << books.waitlist(id).encode() << "\n";
+        }
+        for(auto *u : users) {
+            fout << "U," << u->getUserID() << ","
+                 << u->getPassword() << ","
+                 << u->getName() << ","
+                 << u->getRoleName() << ","
+                 << u->getFine() << ","
+                 << u->account->getReservedBooks().size() << "\n";
+            for(const auto &bi : u->account->getCurrentBorrows()) {
+                fout << "L," << u->getUserID() << "," << bi.ISBN << "," << bi.borrowDay << "\n";
+            }
+            forEachHistory(*u->account, [&](const HistoryEntry &e) {
+                fout << "H," << u->getUserID() << "," << books.isbn(e.bookId) << ","
+                     << e.borrowDay << "," << e.returnDay << "\n";
+            });
+        }
+        if(!commitTempFile(fout, tmpName, filename)) return false;
+        checkpointLogOffset = offset;
+        return true;
+    }
+
+    // Restores state from a checkpoint. Returns the log offset to resume
+    // replay from, or -1 if there is no usable checkpoint for this log (the
+    // caller then falls back to a full load).
+    long long loadCheckpoint(const std::string &filename, const std::string &logFilename) {
+        MetricTimer timer(Metric::LOAD_CHECKPOINT);
+        std::unique_ptr<MappedFile> file(new MappedFile(filename));
+        if(!file->is_open()) return -1;
+        std::string_view rest = file->view(), line;
+        if(!nextLine(rest, line) || line != "LIBRARY-CHECKPOINT 1") return -1;
+
+        std::string_view f[8];
+        long long offset;
+        unsigned long long hash;
+        if(!nextLine(rest, line) || splitFields(line, f, 3) < 3 || f[0] != "log" ||
+           !parseNumber(f[1], offset) || !parseNumber(f[2], hash)) return -1;
+        // The log must still contain exactly what the checkpoint saw
+        if(fileSize(logFilename) < offset || logTailHash(logFilename, offset) != hash) return -1;
+
+        books.clear();
+        bookIndex.clear();
+        searchIndex.clear();
+        searchStale = books.isLazy();
+        ordersStale = true;
+        clearUsers();
+        // books come before users, so accounts learn their reservations at the end
+        std::vector<std::pair<std::size_t, std::size_t>> waiting; // book id, queue position
+        while(nextLine(rest, line)) {
+            std::size_t n = splitFields(line, f, 8);
+            if(f[0] == "B" && n >= 7) {
+                int y;
+                if(!parseNumber(f[5], y)) continue;
+                auto bk = insertLoadedBook(*file, f[1], f[2], f[3], f[4], y, stringToBookStatus(f[6]));
+                if(!bk || n < 8) continue;
+                // "uid:day;uid:day"; older checkpoints hold a single uid
+                std::string_view list = f[7];
+                while(!list.empty()) {
+                    std::size_t end = std::min(list.find(';'), list.size());
+                    std::string_view entry = list.substr(0, end), uid = entry;
+                    list.remove_prefix(std::min(end + 1, list.size()));
+                    long long day = currentDaysSinceEpoch();
+                    std::size_t colon = entry.find(':');
+                    if(colon != std::string_view::npos) {
+                        uid = entry.substr(0, colon);
+                        if(!parseNumber(entry.substr(colon + 1), day)) continue;
+                    }
+                    if(uid.empty()) continue;
+                    bk->editWaitlist().push(uid, day);
+                    waiting.emplace_back(bk->getId(), bk->waitlist().size() - 1);
+                }
+            }
+            else if(f[0] == "U" && n >= 7) {
+                double fine;
+                int reservations; // derived from the waiting lists now
+                if(!parseNumber(f[5], fine) || !parseNumber(f[6], reservations)) continue;
+                User* u = userPool.make(f[4], std::string(f[1]), std::string(f[2]),
+                                        std::string(f[3]), fine);
+                if(!u) continue;
+                u->setFine(fine);
+                if(!insertUser(u)) userPool.destroy(u);
+            }
+            else if(f[0] == "L" && n >= 4) {
+                User* u = findUser(f[1]);
+                long long day;
+                if(!u || !parseNumber(f[3], day) || !u->account->addBorrowed(f[2], day)) continue;
+                auto it = bookIndex.find(f[2]);
+                if(it != bookIndex.end()) trackLoan(*u, it->second, day);
+            }
+            else if(f[0] == "H" && n >= 3) {
+                // borrow/return days were added later; older checkpoints lack them
+                User* u = findUser(f[1]);
+                long long borrowDay = 0, returnDay = 0;
+                if(n >= 5 && (!parseNumber(f[3], borrowDay) || !parseNumber(f[4], returnDay))) continue;
+                if(u) recordHistory(*u, historyBookId(f[2]), borrowDay, returnDay);
+            }
+        }
+        for(const auto &w : waiting) {
+            const Reservation &r = books.waitlist(w.first)[w.second];
+            if(User* u = findUser(r.uid)) u->account->addReservation(books.isbn(w.first), r.day);
+        }
+        if(books.isLazy()) books.setSource(std::move(file));
+        checkpointLogOffset = offset;
+        return offset;
+    }
+
+    void showAllTransactions(const std::string &filename) {
+        txLog.flush();
+        MappedFile file(filename);
+        if(!file.is_open()) {
+            std::cerr << "Could not open " << filename << "\n";
+            return;
+        }
+        std::cout << "\n----- All Transactions -----\n";
+        readTransactionLog(file.view(), 0, [](const TxRecord &rec) {
+            std::cout << "UserID: " << rec.uid
+                      << ", ISBN: " << rec.isbn
+                      << ", Operation: " << rec.opName
+                      << ", DayStamp: " << rec.day << "\n";
+        });
+        std::cout << "-----------------------------\n";
+    }
+
+    void payFine(User &user) {
+        std::cout << "Your outstanding fine is: " << user.getFine() << "\n";
+        std::cout << "Enter amount to pay: ";
+        double amt;
+        std::cin >> amt;
+        std::cout << payFine(user, amt).message;
+    }
+
+    // --------------------------------------------------
+    // Change journal: every save appends only the books/users that changed
+    // since the last save, as whole records:
+    //   +B,ISBN,Title,Author,Publisher,Year     -B,ISBN
+    //   +U,userID,password,name,role,fine       -U,userID
+    // It is applied on top of books.txt/users.txt (or the checkpoint) at
+    // startup, and emptied whenever those are rewritten in full.
+    // Safe to call while requests are being served.
+    // --------------------------------------------------
+    bool saveChanges(const std::string &filename) {
+        MetricTimer timer(Metric::SAVE_CHANGES);
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex); // no adds/removes/edits meanwhile
+        std::unordered_set<std::string> changedBooks, changedUsers;
+        {
+            std::lock_guard<std::mutex> lock(dirtyMutex);
+            if(dirtyBooks.empty() && dirtyUsers.empty()) return true;
+            changedBooks.swap(dirtyBooks);
+            changedUsers.swap(dirtyUsers);
+        }
+        // on failure they are still unsaved (along with whatever changed since)
+        auto keepDirty = [&] {
+            std::lock_guard<std::mutex> lock(dirtyMutex);
+            dirtyBooks.insert(changedBooks.begin(), changedBooks.end());
+            dirtyUsers.insert(changedUsers.begin(), changedUsers.end());
+        };
+        std::ofstream fout(filename, std::ios::app);
+        if(!fout.is_open()) {
+            std::cerr << "Could not open " << filename << "\n";
+            keepDirty();
+            return false;
+        }
+        for(const auto &isbn : changedBooks) {
+            auto b = findBook(isbn);
+            if(!b) {
+                fout << "-B," << isbn << "\n";
+                continue;
+            }
+            BookMeta m = b->getMeta();
+            fout << "+B," << b->getISBN() << ","
+                 << m.title << ","
+                 << m.author << ","
+                 << m.publisher << ","
+                 << m.year << "\n";
+        }
+        for(const auto &uid : changedUsers) {
+            const User* u = findUser(uid);
+            if(!u) {
+                fout << "-U," << uid << "\n";
+                continue;
+            }
+            std::lock_guard<std::mutex> userGuard(userLock(uid)); // fine/password may change under it
+            fout << "+U," << u->getUserID() << ","
+                 << u->getPassword() << ","
+                 << u->getName() << ","
+                 << u->getRoleName() << ","
+                 << u->getFine() << "\n";
+        }
+        fout.close();
+        if(!fout) {
+            keepDirty();
+            return false;
+        }
+        changeRecords += changedBooks.size() + changedUsers.size();
+        return true;
+    }
+
+    void loadChanges(const std::string &filename) {
+        MetricTimer timer(Metric::LOAD_CHANGES);
+        MappedFile file(filename);
+        if(!file.is_open()) return; // no changes since the last full save
+        std::string_view rest = file.view(), line;
+        while(nextLine(rest, line)) {
+            std::string_view f[6];
+            std::size_t n = splitFields(line, f, 6);
+            if(n < 2) continue; // also skips a torn last line
+            ++changeRecords;
+            if(f[0] == "+B" && n == 6) {
+                int y;
+                if(!parseNumber(f[5], y)) continue;
+                auto it = bookIndex.find(f[1]);
+                if(it != bookIndex.end()) {
+                    BookUpdate upd;
+                    upd.title = std::string(f[2]);
+                    upd.author = std::string(f[3]);
+                    upd.publisher = std::string(f[4]);
+                    upd.year = y;
+                    applyBookUpdate(it->second, upd);
+                } else {
+                    insertBook(f[1], f[2], f[3], f[4], y, BookStatus::AVAILABLE);
+                }
+            }
+            else if(f[0] == "-B") {
+                auto it = bookIndex.find(f[1]);
+                if(it != bookIndex.end()) eraseBook(it);
+            }
+            else if(f[0] == "+U" && n == 6) {
+                double fine;
+                if(!parseNumber(f[5], fine)) continue;
+                if(User* u = findUser(f[1])) {
+                    // the record may carry a rehashed password or a new name
+                    u->setPassword(std::string(f[2]));
+                    u->setName(std::string(f[3]));
+                    u->setFine(fine);
+                    userFines.markDirty(UserPool::slotIndex(u));
+                    continue;
+                }
+                User* u = userPool.make(f[4], std::string(f[1]), std::string(f[2]),
+                                        std::string(f[3]), fine);
+                if(u && !insertUser(u)) userPool.destroy(u);
+            }
+            else if(f[0] == "-U") {
+                User* u = findUser(f[1]);
+                if(!u) continue;
+                userIndex.erase(u->getUserIDRef());
+                users.erase(std::find(users.begin(), users.end(), u));
+                userPool.destroy(u);
+            }
+        }
+    }
+
+    // Called once books/users/checkpoint were rewritten in full
+    void clearChanges(const std::string &filename) {
+        std::ofstream(filename, std::ios::trunc);
+        dirtyBooks.clear();
+        dirtyUsers.clear();
+        changeRecords = 0;
+    }
+
+    // True when the journal or the log tail since the last checkpoint got
+    // long enough that startup would notice
+    bool needsCompaction() {
+        return changeRecords > 10000 ||
+               txLog.size() - checkpointLogOffset > 16LL * 1024 * 1024;
+    }
+
+    // Save data (full rewrite through a temp file)
+    void saveBooks(const std::string &filename) {
+        MetricTimer timer(Metric::SAVE_BOOKS);
+        std::string tmpName = filename + ".tmp";
+        std::ofstream fout(tmpName);
+        if(!fout.is_open()) {
+            std::cerr << "Could not open " << tmpName << "\n";
+            return;
+        }
+        {
+            OutputBuffer out(fout);
+            BookCatalog::Scan scan(books);
+            for(std::size_t id = 0; id < books.size(); ++id) {
+                if(books.isRemoved(id)) continue;
+                BookMeta m = scan.meta(id);
+                out << books.isbn(id) << ","
+                    << m.title << ","
+                    << m.author << ","
+                    << m.publisher << ","
+                    << m.year << ","
+                    << (books.status(id) == BookStatus::BORROWED ? "Borrowed" : "Available") << "\n";
+            }
+        }
+        commitTempFile(fout, tmpName, filename);
+    }
+
+    void saveUsers(const std::string &filename) {
+        MetricTimer timer(Metric::SAVE_USERS);
+        std::string tmpName = filename + ".tmp";
+        std::ofstream fout(tmpName);
+        if(!fout.is_open()) {
+            std::cerr << "Could not open " << tmpName << "\n";
+            return;
+        }
+        for(auto *u : users) {
+            fout << u->getUserID() << ","
+                 << u->getPassword() << ","
+                 << u->getName() << ","
+                 << u->getRoleName() << ","
+                 << u->getFine() << "\n";
+        }
+        commitTempFile(fout, tmpName, filename);
+    }
+
+    // --------------------------------------------------
+    // Bulk import/export. Files are CSV, or TSV when the name ends in .tsv,
+    // with an optional header line. Import parses line-aligned chunks of the
+    // file on worker threads, then makes one pass in file order that dedupes
+    // against the index while inserting (the first record of an ID wins),
+    // taking the catalog lock once per kImportBatch records so other
+    // requests get in between. Export formats slices of the catalog on
+    // worker threads and writes them out in order.
+    // --------------------------------------------------
+    static const std::size_t kImportBatch = 4096;
+    static const std::size_t kMaxReportedErrors = 10;
+
+    struct ImportReport {
+        std::size_t added = 0, duplicates = 0, invalid = 0;
+        std::vector<std::string> errors; // the first few invalid lines
+    };
+
+    static void noteInvalid(ImportReport &report, const std::string &filename,
+                            const std::vector<std::size_t> &badLines, std::size_t headerLines) {
+        report.invalid = badLines.size();
+        for(std::size_t k = 0; k < badLines.size() && k < kMaxReportedErrors; ++k) {
+            report.errors.push_back(filename + ":" + std::to_string(badLines[k] + headerLines) + ": invalid record");
+        }
+    }
+
+    // ISBN,Title,Author,Publisher,Year[,Status]. Imported books are available.
+    ImportReport importBooks(const std::string &filename, std::size_t threads) {
+        ImportReport report;
+        MappedFile file(filename);
+        if(!file.is_open()) {
+            report.errors.push_back("Could not open " + filename);
+            return report;
+        }
+        struct Row {
+            std::string_view isbn, title, author, publisher;
+            int year;
+        };
+        char sep = delimiterFor(filename);
+        std::string_view data = file.view();
+        std::size_t header = skipHeader(data, "ISBN");
+        std::vector<std::size_t> badLines;
+        std::vector<Row> rows = parseLinesParallel<Row>(data, threads, [sep](std::string_view line, Row &r) {
+            std::string_view f[7];
+            std::size_t n = splitFields(line, f, 7, sep);
+            if(n < 5 || n > 6 || f[0].empty() || !parseNumber(f[4], r.year)) return false;
+            // books.txt is comma separated, so a TSV field can't contain one
+            for(std::size_t k = 0; k < 4; ++k) {
+                if(!isStorableField(f[k])) return false;
+            }
+            r = Row{f[0], f[1], f[2], f[3], r.year};
+            return true;
+        }, badLines);
+        noteInvalid(report, filename, badLines, header);
+
+        {
+            std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+            bookIndex.reserve(bookIndex.size() + rows.size());
+        }
+        for(std::size_t from = 0; from < rows.size(); from += kImportBatch) {
+            std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+            for(std::size_t k = from; k < std::min(rows.size(), from + kImportBatch); ++k) {
+                const Row &r = rows[k];
+                if(insertBook(r.isbn, r.title, r.author, r.publisher, r.year, BookStatus::AVAILABLE)) {
+                    markBookDirty(std::string(r.isbn));
+                    ++report.added;
+                } else {
+                    ++report.duplicates;
+                }
+            }
+        }
+        return report;
+    }
+
+    // userID,password,name,role[,fine]. Plaintext passwords are hashed on
+    // worker threads, and only for users that are actually new.
+    ImportReport importUsers(const std::string &filename, std::size_t threads) {
+        ImportReport report;
+        MappedFile file(filename);
+        if(!file.is_open()) {
+            report.errors.push_back("Could not open " + filename);
+            return report;
+        }
+        struct Row {
+            std::string_view uid, name;
+            std::string password;
+            Role role;
+            double fine;
+        };
+        char sep = delimiterFor(filename);
+        std::string_view data = file.view();
+        std::size_t header = skipHeader(data, "userID");
+        std::vector<std::size_t> badLines;
+        std::vector<Row> rows = parseLinesParallel<Row>(data, threads, [sep](std::string_view line, Row &r) {
+            std::string_view f[6];
+            std::size_t n = splitFields(line, f, 6, sep);
+            std::optional<Role> role = (n >= 4) ? parseRole(f[3]) : std::nullopt;
+            r.fine = 0.0;
+            if(n < 4 || n > 5 || f[0].empty() || !role) return false;
+            if(n == 5 && (!parseNumber(f[4], r.fine) || r.fine < 0.0)) return false;
+            for(std::size_t k = 0; k < 3; ++k) {
+                if(!isStorableField(f[k])) return false;
+            }
+            r.uid = f[0];
+            r.password = std::string(f[1]);
+            r.name = f[2];
+            r.role = *role;
+            return true;
+        }, badLines);
+        noteInvalid(report, filename, badLines, header);
+
+        // dedupe first, so no time is spent hashing passwords of users we skip
+        std::vector<Row*> fresh;
+        {
+            std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+            std::unordered_set<std::string_view> seen;
+            for(Row &r : rows) {
+                if(userIndex.count(r.uid) || !seen.insert(r.uid).second) ++report.duplicates;
+                else fresh.push_back(&r);
+            }
+        }
+        std::size_t n = std::max<std::size_t>(1, std::min(threads, fresh.size()));
+        runParallel(n, [&](std::size_t t) {
+            for(std::size_t k = t; k < fresh.size(); k += n) {
+                if(!isPasswordHash(fresh[k]->password)) fresh[k]->password = hashPassword(fresh[k]->password);
+            }
+        });
+
+        for(std::size_t from = 0; from < fresh.size(); from += kImportBatch) {
+            std::unique_lock<std::shared_mutex> catalog(catalogMutex);
+            for(std::size_t k = from; k < std::min(fresh.size(), from + kImportBatch); ++k) {
+                const Row &r = *fresh[k];
+                User* u = userPool.make(roleName(r.role), std::string(r.uid), r.password, std::string(r.name), r.fine);
+                if(!insertUser(u)) { // added by someone else meanwhile
+                    userPool.destroy(u);
+                    ++report.duplicates;
+                    continue;
+                }
+                markUserDirty(*u);
+                ++report.added;
+            }
+        }
+        return report;
+    }
+
+    // Writes every book (with a header line) to `filename`; returns how
+    // many. Caller makes sure nothing else runs.
+    std::size_t exportBooks(const std::string &filename, std::size_t threads) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        const char sep = delimiterFor(filename);
+        const std::size_t n = std::max<std::size_t>(1, std::min(threads, books.size()));
+        std::vector<std::string> parts(n);
+        std::vector<std::size_t> counts(n, 0);
+        BookCatalog::Scan scan(books);
+        runParallel(n, [&](std::size_t t) {
+            std::string &out = parts[t];
+            char year[16];
+            for(std::size_t id = books.size() * t / n; id < books.size() * (t + 1) / n; ++id) {
+                if(books.isRemoved(id)) continue;
+                BookMeta m = scan.meta(id);
+                auto res = std::to_chars(year, year + sizeof(year), m.year);
+                out.append(books.isbn(id)).append(1, sep)
+                   .append(m.title).append(1, sep)
+                   .append(m.author).append(1, sep)
+                   .append(m.publisher).append(1, sep)
+                   .append(year, res.ptr).append(1, sep)
+                   .append(books.status(id) == BookStatus::BORROWED ? "Borrowed" : "Available").append(1, '\n');
+                ++counts[t];
+            }
+        });
+        std::string header = std::string("ISBN") + sep + "Title" + sep + "Author" + sep +
+                             "Publisher" + sep + "Year" + sep + "Status\n";
+        if(!writeParts(filename, header, parts)) return 0;
+        return std::accumulate(counts.begin(), counts.end(), (std::size_t) 0);
+    }
+
+    // Writes every user (with a header line) to `filename`; returns how
+    // many. Caller makes sure nothing else runs.
+    std::size_t exportUsers(const std::string &filename, std::size_t threads) {
+        std::shared_lock<std::shared_mutex> catalog(catalogMutex);
+        const char sep = delimiterFor(filename);
+        const std::size_t n = std::max<std::size_t>(1, std::min(threads, users.size()));
+        std::vector<std::string> parts(n);
+        runParallel(n, [&](std::size_t t) {
+            std::string &out = parts[t];
+            for(std::size_t k = users.size() * t / n; k < users.size() * (t + 1) / n; ++k) {
+                const User &u = *users[k];
+                out.append(u.getUserIDRef()).append(1, sep)
+                   .append(u.getPassword()).append(1, sep)
+                   .append(u.getName()).append(1, sep)
+                   .append(u.getRoleName()).append(1, sep)
+                   .append(formatAmount(u.getFine())).append(1, '\n');
+            }
+        });
+        std::string header = std::string("userID") + sep + "password" + sep + "name" + sep +
+                             "role" + sep + "fine\n";
+        if(!writeParts(filename, header, parts)) return 0;
+        return users.size();
+    }
+
+    static bool writeParts(const std::string &filename, const std::string &header,
+                           const std::vector<std::string> &parts) {
+        std::string tmpName = filename + ".tmp";
+        std::ofstream fout(tmpName, std::ios::binary);
+        if(!fout.is_open()) {
+            std::cerr << "Could not open " << tmpName << "\n";
+            return false;
+        }
+        fout.write(header.data(), (std::streamsize) header.size());
+        for(const auto &part : parts) fout.write(part.data(), (std::streamsize) part.size());
+        return commitTempFile(fout, tmpName, filename);
+    }
+};
+
+
+// --------------------------------------------------
+// Fixed-size thread pool running queued tasks in FIFO order
+// --------------------------------------------------
+class WorkerPool {
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable wake;
+    bool stopping;
+
+    void run() {
+        while(true) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if(tasks.empty()) return; // stopping and drained
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+public:
+    explicit WorkerPool(std::size_t n) : stopping(false) {
+        if(n == 0) n = 1;
+        for(std::size_t k = 0; k < n; ++k) workers.emplace_back(&WorkerPool::run, this);
+    }
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto &w : workers) w.join();
+    }
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(std::move(task));
+        }
+        wake.notify_one();
+    }
+};
+
+
+// Rewrites books.txt, users.txt and the checkpoint in full; after that the
+// change journal is redundant and gets emptied.
+void compactLibrary(Library &lib) {
+    lib.saveBooks("books.txt");
+    lib.saveUsers("users.txt");
+    if(lib.saveCheckpoint("library.ckpt", "transactions.txt")) {
+        lib.clearChanges("library.delta");
+    }
+}
+
+// Logout: persist only what changed, compacting once the journal grows
+void saveSession(Library &lib) {
+    lib.saveChanges("library.delta");
+    if(lib.needsCompaction()) compactLibrary(lib);
+}
+
+
+#ifdef LIBRARY_HAVE_POSIX
+// --------------------------------------------------
+// Server mode: serves many patrons at once over a local Unix socket.
+// One front-end thread polls every connection; each complete request line
+// is handed to the worker pool, and a connection gets its next request
+// dispatched only after the previous reply was queued, so replies stay in
+// order. Replies go out as the socket takes them; a client that doesn't
+// read them (or sends too much ahead) is simply not served until it does.
+// Changes are journaled every second and when a patron disconnects, and
+// compacted between requests once the journal grows. Line protocol (replies: "OK ..." / "ERR <STATUS> ...", any data
+// lines, then an empty line):
+//   LOGIN <userID> <password>
+//   BORROW <ISBN> | RESERVE <ISBN> | CANCEL <ISBN> | RETURN <ISBN>
+//   FIND <ISBN> | BOOKS | SEARCH <words> | ACCOUNT | QUIT
+// SIGHUP reloads the lending policy file without pausing the workers.
+// --------------------------------------------------
+volatile sig_atomic_t serverStopRequested = 0;
+volatile sig_atomic_t serverReloadRequested = 0;
+int serverWakeFd = -1; // write end of the front end's wake-up pipe
+
+extern "C" void onServerSignal(int sig) {
+    if(sig == SIGHUP) serverReloadRequested = 1;
+    else serverStopRequested = 1;
+    if(serverWakeFd >= 0) {
+        char c = 0;
+        (void) !::write(serverWakeFd, &c, 1);
+    }
+}
+
+class LibraryServer {
+private:
+    static const std::size_t kMaxInbox = 64 * 1024;   // unhandled request bytes per connection
+    static const std::size_t kMaxOutbox = 256 * 1024; // unsent reply bytes before we stop serving it
+    static const int kSaveIntervalMs = 1000;
+
+    struct Connection {
+        int fd;
+        std::string inbox;   // bytes received but not yet handled
+        std::string reply;   // written by the worker that owns the connection
+        std::string outbox;  // replies not yet sent (front end only)
+        User* user = nullptr; // set by LOGIN
+        bool busy = false;    // a worker owns this connection right now
+        bool quit = false;    // QUIT seen (worker side)
+        bool closing = false; // close once the outbox is sent (front end side)
+    };
+
+    Library &lib;
+    std::string policyFile;
+    WorkerPool pool;
+    int listenFd;
+    int wakePipe[2];
+    std::unordered_map<int, std::unique_ptr<Connection>> conns; // front-end thread only
+    std::mutex doneMtx;
+    std::vector<int> done; // connections whose request finished
+    std::size_t inFlight = 0;     // requests handed to the pool
+    bool compactPending = false;  // no dispatching until the pool is idle and we've compacted
+    bool saveNow = false;         // a patron left; journal their changes
+    std::chrono::steady_clock::time_point lastSave;
+
+    // Sends what the socket takes without blocking; false if the connection broke
+    static bool flush(Connection &c) {
+        while(!c.outbox.empty()) {
+            ssize_t n = ::send(c.fd, c.outbox.data(), c.outbox.size(), MSG_NOSIGNAL);
+            if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if(n <= 0) return false;
+            c.outbox.erase(0, (std::size_t) n);
+        }
+        return true;
+    }
+
+    static void reply(std::string &out, const OpResult &res) {
+        if(res.status == OpStatus::OK) out.append("OK\n");
+        else out.append("ERR ").append(opStatusName(res.status)).append("\n");
+        out.append(res.message);
+    }
+
+    // Runs on a worker. Only this worker touches `c` until it is handed back.
+    void handle(Connection &c, const std::string &line) {
+        std::istringstream in(line);
+        std::string cmd, arg1, arg2;
+        in >> cmd >> arg1 >> arg2;
+        std::string out;
+
+        if(cmd == "LOGIN") {
+            User* u;
+            reply(out, lib.authenticate(arg1, arg2, u));
+            if(u) c.user = u;
+        } else if(cmd == "QUIT") {
+            reply(out, OpResult::ok("Bye."));
+            c.quit = true;
+        } else if(cmd == "FIND") {
+            std::string data;
+            if(lib.describeBook(data, arg1)) reply(out, OpResult::ok(""));
+            else reply(out, OpResult::fail(OpStatus::NOT_FOUND, "Book not found."));
+            out.append(data);
+        } else if(cmd == "BOOKS") {
+            reply(out, OpResult::ok(""));
+            lib.describeAllBooks(out);
+        } else if(cmd == "SEARCH") {
+            reply(out, OpResult::ok(""));
+            lib.searchBooks(out, std::string_view(line).substr(std::min(line.size(), cmd.size() + 1)), 20);
+        } else if(!c.user) {
+            reply(out, OpResult::fail(OpStatus::DENIED, "Login first."));
+        } else if(cmd == "BORROW") {
+            reply(out, lib.tryBorrow(*c.user, arg1));
+        } else if(cmd == "RESERVE") {
+            reply(out, lib.tryReserve(*c.user, arg1));
+        } else if(cmd == "CANCEL") {
+            reply(out, lib.cancelReservation(*c.user, arg1));
+        } else if(cmd == "RETURN") {
+            reply(out, lib.tryReturn(*c.user, arg1));
+        } else if(cmd == "ACCOUNT") {
+            reply(out, OpResult::ok(""));
+            lib.describeAccount(out, *c.user);
+        } else {
+            reply(out, OpResult::fail(OpStatus::INVALID, "Unknown command: " + cmd));
+        }
+        out.append("\n");
+        c.reply.append(out);
+    }
+
+    // Front end: hand the next buffered request of an idle connection to the
+    // pool, unless its earlier replies are still piling up
+    void dispatch(Connection &c) {
+        if(c.busy || c.closing || compactPending || c.outbox.size() >= kMaxOutbox) return;
+        std::size_t nl = c.inbox.find('\n');
+        if(nl == std::string::npos) return;
+        std::string line = c.inbox.substr(0, nl);
+        c.inbox.erase(0, nl + 1);
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        c.busy = true;
+        ++inFlight;
+        Connection* cp = &c;
+        pool.post([this, cp, line] {
+            handle(*cp, line);
+            {
+                std::lock_guard<std::mutex> lock(doneMtx);
+                done.push_back(cp->fd);
+            }
+            char x = 0;
+            (void) !::write(wakePipe[1], &x, 1);
+        });
+    }
+
+    // A connection a worker owns is closed once its request is done
+    void closeConnection(Connection &c) {
+        if(c.busy) {
+            c.closing = true;
+            c.outbox.clear();
+            return;
+        }
+        if(c.user) saveNow = true; // like a console logout
+        int fd = c.fd;
+        ::close(fd);
+        conns.erase(fd);
+    }
+
+    // Journals what changed; compacting waits until no request is running
+    void persist() {
+        lib.saveChanges("library.delta");
+        if(lib.needsCompaction()) compactPending = true;
+        lastSave = std::chrono::steady_clock::now();
+        saveNow = false;
+    }
+
+    // Front end: a worker finished the request of `fd`
+    void finish(int fd) {
+        --inFlight;
+        auto it = conns.find(fd);
+        if(it == conns.end()) return;
+        Connection &c = *it->second;
+        c.busy = false;
+        if(c.quit) c.closing = true;
+        c.outbox.append(c.reply);
+        c.reply.clear();
+        if(!flush(c) || (c.closing && c.outbox.empty())) closeConnection(c);
+        else dispatch(c);
+    }
+
+    std::vector<int> takeFinished() {
+        char buf[256];
+        while(::read(wakePipe[0], buf, sizeof(buf)) > 0) {}
+        std::vector<int> finished;
+        std::lock_guard<std::mutex> lock(doneMtx);
+        finished.swap(done);
+        return finished;
+    }
+
+public:
+    LibraryServer(Library &l, std::size_t workers, const std::string &policy)
+        : lib(l), policyFile(policy), pool(workers), listenFd(-1) {
+        wakePipe[0] = wakePipe[1] = -1;
+    }
+    ~LibraryServer() {
+        for(auto &kv : conns) ::close(kv.first);
+        if(listenFd >= 0) ::close(listenFd);
+        if(wakePipe[0] >= 0) ::close(wakePipe[0]);
+        if(wakePipe[1] >= 0) ::close(wakePipe[1]);
+    }
+
+    // Serves until SIGINT/SIGTERM; returns false if the socket can't be set up
+    bool run(const std::string &socketPath) {
+        sockaddr_un addr{};
+        if(socketPath.size() >= sizeof(addr.sun_path)) {
+            std::cerr << "Socket path too long: " << socketPath << "\n";
+            return false;
+        }
+        if(::pipe(wakePipe) != 0) return false;
+        ::fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+        ::fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+        serverWakeFd = wakePipe[1];
+        signal(SIGINT, onServerSignal);
+        signal(SIGTERM, onServerSignal);
+        signal(SIGHUP, onServerSignal);
+
+        listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        addr.sun_family = AF_UNIX;
+        std::copy(socketPath.begin(), socketPath.end(), addr.sun_path);
+        ::unlink(socketPath.c_str());
+        if(listenFd < 0 || ::bind(listenFd, (sockaddr*) &addr, sizeof(addr)) != 0 ||
+           ::listen(listenFd, 128) != 0) {
+            std::cerr << "Could not listen on " << socketPath << "\n";
+            return false;
+        }
+        ::chmod(socketPath.c_str(), 0600); // only our OS user may connect
+        std::cout << "Serving on " << socketPath << "\n";
+
+        std::vector<pollfd> fds;
+        lastSave = std::chrono::steady_clock::now();
+        while(!serverStopRequested) {
+            fds.clear();
+            fds.push_back(pollfd{listenFd, POLLIN, 0});
+            fds.push_back(pollfd{wakePipe[0], POLLIN, 0});
+            for(auto &kv : conns) {
+                const Connection &c = *kv.second;
+                short events = 0;
+                // a full inbox waits for dispatch to drain it; the socket buffer pushes back on the client
+                if(!c.busy && !c.closing && c.inbox.size() < kMaxInbox) events |= POLLIN;
+                if(!c.outbox.empty()) events |= POLLOUT;
+                if(events) fds.push_back(pollfd{kv.first, events, 0});
+            }
+            int ready = ::poll(fds.data(), fds.size(), kSaveIntervalMs);
+
+            if(saveNow || std::chrono::steady_clock::now() - lastSave >=
+                          std::chrono::milliseconds(kSaveIntervalMs)) persist();
+            if(compactPending && inFlight == 0) {
+                compactLibrary(lib);
+                compactPending = false;
+                for(auto &kv : conns) dispatch(*kv.second);
+            }
+            if(ready <= 0) continue; // timeout or EINTR
+
+            if(serverReloadRequested) {
+                serverReloadRequested = 0;
+                std::string error;
+                if(reloadLendingPolicy(policyFile, error)) {
+                    std::cout << "Lending policy reloaded from " << policyFile << "\n";
+                } else {
+                    std::cerr << "Lending policy not changed: " << error << "\n";
+                }
+            }
+
+            if(fds[1].revents & POLLIN) {
+                for(int fd : takeFinished()) finish(fd);
             }
-            if(uPtr) {
-                uPtr->account = new Account();
-                uPtr->setFine(f);
-                users.push_back(uPtr);
+            if(fds[0].revents & POLLIN) {
+                int fd = ::accept(listenFd, nullptr, nullptr);
+                if(fd >= 0) {
+                    ::fcntl(fd, F_SETFL, O_NONBLOCK);
+                    auto c = std::make_unique<Connection>();
+                    c->fd = fd;
+                    conns[fd] = std::move(c);
+                }
+            }
+            for(std::size_t k = 2; k < fds.size(); ++k) {
+                if(!fds[k].revents) continue;
+                auto it = conns.find(fds[k].fd);
+                if(it == conns.end()) continue;
+                Connection &c = *it->second;
+                if(fds[k].revents & POLLOUT) {
+                    if(!flush(c)) {
+                        closeConnection(c);
+                        continue;
+                    }
+                    if(c.closing && c.outbox.empty()) {
+                        closeConnection(c);
+                        continue;
+                    }
+                    dispatch(c); // it may have been waiting for the outbox to drain
+                }
+                if(!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+                if(c.busy || c.closing) continue; // only polled for output; the next round sees it
+                char buf[4096];
+                ssize_t n = ::recv(c.fd, buf, sizeof(buf), 0);
+                if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+                if(n <= 0) {
+                    closeConnection(c);
+                    continue;
+                }
+                c.inbox.append(buf, (std::size_t) n);
+                if(c.inbox.size() >= kMaxInbox && c.inbox.find('\n') == std::string::npos) {
+                    closeConnection(c); // one request that long is not a request
+                    continue;
+                }
+                dispatch(c);
             }
         }
-        fin.close();
+        std::cout << "Shutting down server...\n";
+        // the running requests still use their connections
+        while(inFlight > 0) {
+            pollfd wake{wakePipe[0], POLLIN, 0};
+            ::poll(&wake, 1, -1);
+            for(int fd : takeFinished()) finish(fd);
+        }
+        ::unlink(socketPath.c_str());
+        serverWakeFd = -1;
+        return true;
     }
+};
+#endif
 
-    
-    void loadTransactions(const std::string &filename) {
-        std::ifstream fin(filename);
-        if(!fin.is_open()) {
-            std::cerr << "Could not open " << filename << "\n";
-            return;
+// --------------------------------------------------
+// Minimal JSON support for batch mode: flat objects whose values are
+// strings, numbers, booleans or null (non-string values are kept as text).
+// --------------------------------------------------
+using JsonObject = std::unordered_map<std::string, std::string>;
+
+bool parseJsonString(std::string_view &in, std::string &out) {
+    if(in.empty() || in.front() != '"') return false;
+    in.remove_prefix(1);
+    out.clear();
+    while(!in.empty()) {
+        char c = in.front();
+        in.remove_prefix(1);
+        if(c == '"') return true;
+        if(c != '\\') {
+            out.push_back(c);
+            continue;
         }
-        std::string line;
-        while(std::getline(fin, line)) {
-            if(line.empty()) continue;
-            std::stringstream ss(line);
-            std::string uid, isbn, op, dayStr;
-            std::getline(ss, uid, ',');
-            std::getline(ss, isbn, ',');
-            std::getline(ss, op, ',');
-            std::getline(ss, dayStr, ',');
-
-            // We ignore dayStamp except for ordering
-            long long dayStamp = std::stoll(dayStr);
-
-            User* u = findUser(uid);
-            Book* b = findBook(isbn);
-            if(!u || !b) continue; // skip bad lines
-
-            if(op == "borrow") {
-                b->setStatus(BookStatus::BORROWED);
-                b->setReservedBy(""); 
-                u->account->addBorrowed(isbn);
-            }
-            else if(op == "return") {
-                u->account->returnBorrowed(isbn);
-                b->setStatus(BookStatus::AVAILABLE);
-            }
-            else if(op == "reserve") {
-                if(b->getStatus() == BookStatus::BORROWED &&
-                   b->getReservedBy().empty())
-                {
-                    b->setReservedBy(uid);
+        if(in.empty()) return false;
+        char e = in.front();
+        in.remove_prefix(1);
+        switch(e) {
+            case 'n': out.push_back('\n'); break;
+            case 't': out.push_back('\t'); break;
+            case 'r': out.push_back('\r'); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'u': {
+                unsigned cp = 0;
+                if(in.size() < 4 || std::from_chars(in.data(), in.data() + 4, cp, 16).ptr != in.data() + 4) return false;
+                in.remove_prefix(4);
+                // UTF-8 encode (surrogate pairs are not combined)
+                if(cp < 0x80) {
+                    out.push_back((char) cp);
+                } else if(cp < 0x800) {
+                    out.push_back((char) (0xC0 | (cp >> 6)));
+                    out.push_back((char) (0x80 | (cp & 0x3F)));
+                } else {
+                    out.push_back((char) (0xE0 | (cp >> 12)));
+                    out.push_back((char) (0x80 | ((cp >> 6) & 0x3F)));
+                    out.push_back((char) (0x80 | (cp & 0x3F)));
                 }
+                break;
             }
+            default: out.push_back(e); break; // \" \\ \/
         }
-        fin.close();
     }
+    return false;
+}
 
-    
-    User* findUser(const std::string &uid) {
-        for(auto *u : users) {
-            if(u->getUserID() == uid) return u;
+bool parseJsonObject(std::string_view in, JsonObject &obj) {
+    auto skipSpace = [&in] {
+        while(!in.empty() && (in.front() == ' ' || in.front() == '\t' || in.front() == '\r')) in.remove_prefix(1);
+    };
+    obj.clear();
+    skipSpace();
+    if(in.empty() || in.front() != '{') return false;
+    in.remove_prefix(1);
+    skipSpace();
+    if(!in.empty() && in.front() == '}') return true;
+    while(true) {
+        std::string key, value;
+        skipSpace();
+        if(!parseJsonString(in, key)) return false;
+        skipSpace();
+        if(in.empty() || in.front() != ':') return false;
+        in.remove_prefix(1);
+        skipSpace();
+        if(!in.empty() && in.front() == '"') {
+            if(!parseJsonString(in, value)) return false;
+        } else {
+            std::size_t end = in.find_first_of(",} \t");
+            if(end == 0 || end == std::string_view::npos) return false;
+            value = std::string(in.substr(0, end));
+            in.remove_prefix(end);
         }
-        return nullptr;
+        obj[key] = value;
+        skipSpace();
+        if(in.empty()) return false;
+        if(in.front() == '}') return true;
+        if(in.front() != ',') return false;
+        in.remove_prefix(1);
     }
+}
 
-    Book* findBook(const std::string &isbn) {
-        for(auto &b : books) {
-            if(b.getISBN() == isbn) return &b;
+void appendJsonString(std::string &out, std::string_view s) {
+    out.push_back('"');
+    for(char c : s) {
+        switch(c) {
+            case '"':  out.append("\\\""); break;
+            case '\\': out.append("\\\\"); break;
+            case '\n': out.append("\\n"); break;
+            case '\t': out.append("\\t"); break;
+            case '\r': out.append("\\r"); break;
+            default:
+                if((unsigned char) c < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", (unsigned) c);
+                    out.append(buf);
+                } else {
+                    out.push_back(c);
+                }
         }
-        return nullptr;
     }
+    out.push_back('"');
+}
 
-    void appendTransaction(const std::string &uid,
-                           const std::string &isbn,
-                           const std::string &op) {
-        std::ofstream fout("transactions.txt", std::ios::app);
-        if(!fout.is_open()) {
-            std::cerr << "Cannot open transactions.txt for append.\n";
-            return;
-        }
-        long long dayStamp = currentDaysSinceEpoch();
-        fout << uid << "," << isbn << "," << op << "," << dayStamp << "\n";
-        fout.close();
-    }
 
-    
-    bool hasOverdueMoreThan60Days(User &faculty) {
-        auto &borrows = faculty.account->getCurrentBorrows();
-        int maxDays = faculty.getMaxBorrowDays(); // 30 for Faculty
-        for(auto &binfo : borrows) {
-            long long diff = currentDaysSinceEpoch() - binfo.borrowDay;
-            if(diff > (maxDays + 60)) {
-                return true;
-            }
-        }
-        return false;
-    }
+// --------------------------------------------------
+// Batch mode: runs JSON-lines commands with no prompts and writes one JSON
+// result line per command, e.g.
+//   {"id":"7","op":"borrow","user":"s01","isbn":"111"}
+//   {"line":1,"id":"7","op":"borrow","status":"OK","message":"Book borrowed successfully."}
+// ops and their fields:
+//   borrow (user, isbn, reserve:true to reserve if it is out), reserve,
+//   cancel (user, isbn: drop a reservation), return (user, isbn), pay_fine (user, amount), find_book (isbn),
+//   add_book (isbn, title, author, publisher, year),
+//   update_book (isbn, any of title/author/publisher/year), remove_book (isbn),
+//   add_user (user, password, name, role), remove_user (user)
+// --------------------------------------------------
+OpResult runBatchCommand(Library &lib, const JsonObject &cmd, std::string &data) {
+    auto field = [&cmd](const char* name) -> std::string {
+        auto it = cmd.find(name);
+        return (it == cmd.end()) ? std::string() : it->second;
+    };
+    auto has = [&cmd](const char* name) { return cmd.count(name) > 0; };
+    std::string op = field("op");
 
-    void borrowBook(User &user, const std::string &isbn) {
-        // Check if user is already borrowing
-        if(user.account->isBorrowing(isbn)) {
-            std::cout << "You are already borrowing this book; can't borrow/reserve it.\n";
-            return;
-        }
-        // Librarian can't borrow
-        if(user.getRole() == "Librarian") {
-            std::cout << "Librarian cannot borrow.\n";
-            return;
+    if(op == "borrow" || op == "reserve" || op == "cancel" || op == "return" || op == "pay_fine") {
+        User* u = lib.findUserShared(field("user"));
+        if(!u) return OpResult::fail(OpStatus::NOT_FOUND, "No such user.");
+        if(op == "pay_fine") {
+            double amount;
+            if(!parseNumber(field("amount"), amount)) return OpResult::fail(OpStatus::INVALID, "Bad amount.");
+            return lib.payFine(*u, amount);
         }
-        // Student must pay fine first
-        if(user.getRole() == "Student" && user.getFine() > 0.0) {
-            std::cout << "You have unpaid fines; pay first.\n";
-            return;
+        std::string isbn = field("isbn");
+        if(op == "return")  return lib.tryReturn(*u, isbn);
+        if(op == "reserve") return lib.tryReserve(*u, isbn);
+        if(op == "cancel")  return lib.cancelReservation(*u, isbn);
+        OpResult res = lib.tryBorrow(*u, isbn);
+        if(res.status == OpStatus::RESERVABLE && field("reserve") == "true") {
+            res = lib.tryReserve(*u, isbn);
         }
-        // Check limit: borrowed+reserved should be less than max allowed
-        if(user.account->borrowedCount() + user.account->getReservations() >= user.getMaxBooksAllowed()) {
-            std::cout << "You reached max books allowed.\n";
-            return;
+        return res;
+    }
+    if(op == "find_book") {
+        if(!lib.describeBook(data, field("isbn"))) return OpResult::fail(OpStatus::NOT_FOUND, "Book not found.");
+        return OpResult::ok("");
+    }
+    if(op == "add_book" || op == "update_book") {
+        int year = 0;
+        if(has("year") && !parseNumber(field("year"), year)) {
+            return OpResult::fail(OpStatus::INVALID, "Bad year.");
         }
-        // Faculty check overdue > 60 days
-        if(user.getRole() == "Faculty") {
-            if(hasOverdueMoreThan60Days(user)) {
-                std::cout << "Cannot borrow; you have a book overdue > 60 days.\n";
-                return;
-            }
+        if(op == "add_book") {
+            return lib.addBook(field("isbn"), field("title"), field("author"), field("publisher"), year);
         }
+        BookUpdate upd;
+        if(has("title"))     upd.title = field("title");
+        if(has("author"))    upd.author = field("author");
+        if(has("publisher")) upd.publisher = field("publisher");
+        upd.year = year;
+        return lib.updateBook(field("isbn"), upd);
+    }
+    if(op == "remove_book") return lib.removeBook(field("isbn"));
+    if(op == "add_user")    return lib.addUser(field("user"), field("password"), field("name"), field("role"));
+    if(op == "remove_user") return lib.removeUser(field("user"));
+    return OpResult::fail(OpStatus::INVALID, "Unknown op: " + op);
+}
 
-        Book* b = findBook(isbn);
-        if(!b) {
-            std::cout << "Book not found.\n";
-            return;
+// Returns the number of commands that did not succeed
+std::size_t runBatch(Library &lib, std::string_view input, std::ostream &out) {
+    std::string buf, data;
+    JsonObject cmd;
+    std::size_t lineNo = 0, total = 0, failed = 0;
+    std::string_view line;
+    while(nextLine(input, line)) {
+        ++lineNo;
+        if(line.find_first_not_of(" \t") == std::string_view::npos) continue;
+        ++total;
+        data.clear();
+        OpResult res;
+        if(!parseJsonObject(line, cmd)) {
+            cmd.clear();
+            res = OpResult::fail(OpStatus::INVALID, "Malformed JSON.");
+        } else {
+            res = runBatchCommand(lib, cmd, data);
         }
+        if(res.status != OpStatus::OK) ++failed;
 
-        // If someone else is borrowing it, offer reservation
-        if(b->getStatus() == BookStatus::BORROWED) {
-            std::cout << "This book is already borrowed by someone else.\n";
-            if(!b->getReservedBy().empty()) {
-                std::cout << "It's already reserved by: " << b->getReservedBy() << "\n";
-            } else {
-                std::cout << "Do you want to reserve it? (y/n): ";
-                char c;
-                std::cin >> c;
-                if(c=='y' || c=='Y') {
-                    b->setReservedBy(user.getUserID());
-                    appendTransaction(user.getUserID(), isbn, "reserve");
-                    user.account->updateReservations(user.account->getReservations() + 1);
-                    std::cout << "Book reserved successfully.\n";
-                }
-            }
-            return;
+        buf.append("{\"line\":").append(std::to_string(lineNo));
+        auto id = cmd.find("id");
+        if(id != cmd.end()) {
+            buf.append(",\"id\":");
+            appendJsonString(buf, id->second);
         }
-
-        // Otherwise it's available => borrow now
-        b->setStatus(BookStatus::BORROWED);
-        user.account->addBorrowed(isbn);
-        // Clear any previous reservation just in case
-        b->setReservedBy("");
-        appendTransaction(user.getUserID(), isbn, "borrow");
-        std::cout << "Book borrowed successfully.\n";
-    }
-
-    
-    void returnBook(User &user, const std::string &isbn) {
-        if(user.getRole() == "Librarian") {
-            std::cout << "Librarian doesn't borrow books.\n";
-            return;
+        auto op = cmd.find("op");
+        if(op != cmd.end()) {
+            buf.append(",\"op\":");
+            appendJsonString(buf, op->second);
         }
-        // Must actually be borrowing
-        if(!user.account->isBorrowing(isbn)) {
-            std::cout << "You are not borrowing this book.\n";
-            return;
+        buf.append(",\"status\":");
+        appendJsonString(buf, opStatusName(res.status));
+        std::string_view msg(res.message);
+        while(!msg.empty() && msg.back() == '\n') msg.remove_suffix(1);
+        buf.append(",\"message\":");
+        appendJsonString(buf, msg);
+        if(!data.empty()) {
+            if(data.back() == '\n') data.pop_back();
+            buf.append(",\"data\":");
+            appendJsonString(buf, data);
         }
-
-        // Overdue check
-        long long dayStamp = user.account->getBorrowDay(isbn);
-        long long diff = currentDaysSinceEpoch() - dayStamp;
-        int maxDays = user.getMaxBorrowDays();
-        if(diff > maxDays && user.getRole() == "Student") {
-            long long overdueDays = diff - maxDays;
-            double addedFine = overdueDays * 10.0;
-            user.setFine(user.getFine() + addedFine);
-            std::cout << "Book overdue by " << overdueDays
-                      << " days. Fine added: " << addedFine << "\n";
-        } else if(diff > maxDays && user.getRole() == "Faculty") {
-            long long overdueDays = diff - maxDays;
-            std::cout << "Returned " << overdueDays 
-                      << " days late. (No fine for faculty)\n";
+        buf.append("}\n");
+        if(buf.size() >= (1 << 16)) {
+            out.write(buf.data(), (std::streamsize) buf.size());
+            buf.clear();
         }
+    }
+    out.write(buf.data(), (std::streamsize) buf.size());
+    out.flush();
+    std::cerr << "Batch: " << total << " commands, " << (total - failed) << " ok, "
+              << failed << " failed\n";
+    return failed;
+}
 
-        // Remove from user's borrowed list
-        user.account->returnBorrowed(isbn);
 
-        Book* b = findBook(isbn);
-        if(!b) {
-            // Should never happen if user had it, but just in case
-            std::cout << "Book not found in library list.\n";
-            return;
-        }
+// --------------------------------------------------
+// Synthetic data and benchmarks. --generate writes books/users/transactions
+// files of any size with skewed (Zipf-like) book popularity; --bench loads
+// such a directory and times the hot paths.
+// --------------------------------------------------
 
-        // Step 1: Append the "return" transaction now
-        // so that the transaction log sees them returning
-        appendTransaction(user.getUserID(), isbn, "return");
+// Draws ranks 0..n-1 with P(k) ~ 1/(k+1)^s. Uses the inverse of the
+// continuous power law, so it needs no table even for 1e8 items.
+class SkewedPicker {
+private:
+    double n, s;
+public:
+    SkewedPicker(std::size_t count, double skew) : n((double) std::max<std::size_t>(count, 1)), s(skew) {}
 
-        // Step 2: Set the book to AVAILABLE in memory first
-        b->setStatus(BookStatus::AVAILABLE);
+    std::size_t operator()(std::mt19937_64 &rng) const {
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double x;
+        if(std::fabs(s - 1.0) < 1e-9) x = std::pow(n + 1, u);
+        else x = std::pow(1 + u * (std::pow(n + 1, 1 - s) - 1), 1 / (1 - s));
+        return std::min((std::size_t) x - 1, (std::size_t) n - 1);
+    }
+};
+
+std::string syntheticIsbn(std::size_t id) {
+    char buf[24];
+    std::snprintf(buf, sizeof(buf), "978%010zu", id);
+    return buf;
+}
 
-        // Step 3: If it was reserved by someone else, give it to them immediately
-        if(!b->getReservedBy().empty()) {
-            std::string reservedUID = b->getReservedBy();
-            User* reservedUser = findUser(reservedUID);
-            b->setReservedBy(""); // clear reservation
+// Writes books.txt, users.txt and transactions.txt into `dir`. User "admin"
+// (password "admin") is the librarian; the rest are u1..uN with password
+// "pw". The log covers the last year: borrows pick books by popularity, a
+// borrowed book gets a reservation now and then, and a return of a reserved
+// book is followed by the hand-off borrow, as the program itself logs it.
+bool generateData(const std::string &dir, std::size_t nBooks, std::size_t nUsers,
+                  std::size_t nTransactions, double skew) {
+    static const char* const words[] = {
+        "Silent", "River", "Shadow", "Garden", "Winter", "Empire", "Glass", "Secret",
+        "Last", "Journey", "Night", "Ocean", "Stone", "Fire", "Letters", "Machine"};
+    std::mt19937_64 rng(42);
+    nBooks = std::max<std::size_t>(nBooks, 1);
+    nUsers = std::max<std::size_t>(nUsers, 2);
 
-            if(reservedUser) {
-                // set it borrowed by that user
-                b->setStatus(BookStatus::BORROWED);
-                reservedUser->account->addBorrowed(isbn);
+    std::ofstream booksOut(dir + "/books.txt"), usersOut(dir + "/users.txt"),
+                  txOut(dir + "/transactions.txt");
+    if(!booksOut.is_open() || !usersOut.is_open() || !txOut.is_open()) {
+        std::cerr << "Could not create the data files in " << dir << "\n";
+        return false;
+    }
+    {
+        OutputBuffer out(booksOut);
+        std::size_t authors = nBooks / 20 + 1;
+        for(std::size_t id = 0; id < nBooks; ++id) {
+            out << syntheticIsbn(id) << ",The " << words[id % 16] << " " << words[(id / 16) % 16]
+                << " " << (unsigned long) id << ",Author " << (unsigned long) (id * 7919 % authors)
+                << ",Publisher " << (int) (id % 50) << "," << (int) (1900 + id % 125) << ",Available\n";
+        }
+    }
+    {
+        OutputBuffer out(usersOut);
+        out << "admin,admin,Admin,Librarian,0\n";
+        for(std::size_t k = 1; k < nUsers; ++k) {
+            out << "u" << (unsigned long) k << ",pw,User " << (unsigned long) k << ","
+                << (k % 5 == 0 ? "Faculty" : "Student") << ",0\n";
+        }
+    }
 
-                // record the auto-borrow in transactions
-                appendTransaction(reservedUID, isbn, "borrow");
+    // popularity rank -> book id; the stride scatters hot books over the catalog
+    std::size_t stride = nBooks * 618 / 1000 + 1;
+    while(std::gcd(stride, nBooks) != 1) ++stride;
+    SkewedPicker pickBook(nBooks, skew);
+    std::uniform_int_distribution<std::size_t> pickUser(1, nUsers - 1);
+    std::uniform_real_distribution<double> coin(0.0, 1.0);
 
-                std::cout << "Book auto-borrowed by reserved user: " 
-                          << reservedUID << "\n";
-            }
-            else {
-                // if no such user actually exists, remain available
-                b->setStatus(BookStatus::AVAILABLE);
+    std::deque<std::pair<std::size_t, std::size_t>> loans; // (book, user), oldest first
+    std::unordered_set<std::size_t> onLoan;
+    std::unordered_map<std::size_t, std::size_t> reservedBy;
+    std::size_t maxLoans = std::min<std::size_t>(std::max<std::size_t>(nBooks / 4, 1), 1 << 20);
+    long long firstDay = currentDaysSinceEpoch() - 365;
+    OutputBuffer out(txOut);
+    auto log = [&](std::size_t user, std::size_t book, std::string_view op, long long day) {
+        out << "u" << (unsigned long) user << "," << syntheticIsbn(book) << "," << op << "," << day << "\n";
+    };
+    for(std::size_t k = 0; k < nTransactions; ) {
+        long long day = firstDay + (long long) (k * 365 / std::max<std::size_t>(nTransactions, 1));
+        if(!loans.empty() && (loans.size() >= maxLoans || coin(rng) < 0.45)) {
+            auto [book, user] = loans.front();
+            loans.pop_front();
+            log(user, book, "return", day);
+            ++k;
+            auto r = reservedBy.find(book);
+            // the hand-off to the reserving user is a second record; with no
+            // budget left for it the book just stays returned
+            if(r == reservedBy.end() || k == nTransactions) {
+                onLoan.erase(book);
+                continue;
             }
+            log(r->second, book, "borrow", day);
+            ++k;
+            loans.emplace_back(book, r->second);
+            reservedBy.erase(r);
+            continue;
+        }
+        std::size_t book = pickBook(rng) * stride % nBooks;
+        std::size_t user = pickUser(rng);
+        if(!onLoan.count(book)) {
+            log(user, book, "borrow", day);
+            onLoan.insert(book);
+            loans.emplace_back(book, user);
+            ++k;
+        } else if(coin(rng) < 0.05 && reservedBy.emplace(book, user).second) {
+            log(user, book, "reserve", day);
+            ++k;
         }
-        // else if no reservation, remain AVAILABLE
-
-        std::cout << "Book returned successfully.\n";
     }
+    out.flush();
+    std::cout << "Wrote " << nBooks << " books, " << nUsers << " users and "
+              << nTransactions << " transactions to " << dir << "\n";
+    return (bool) booksOut && (bool) usersOut && (bool) txOut;
+}
 
-    void addBook() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::string i,t,a,p;
-        int y;
-        std::cout << "Enter ISBN: ";
-        std::getline(std::cin, i);
-        if(findBook(i)) {
-            std::cout << "Book with this ISBN already exists!\n";
-            return;
-        }
-        std::cout << "Enter Title: ";
-        std::getline(std::cin, t);
-        std::cout << "Enter Author: ";
-        std::getline(std::cin, a);
-        std::cout << "Enter Publisher: ";
-        std::getline(std::cin, p);
-        std::cout << "Enter Year: ";
-        std::cin >> y;
+// Discards everything written to it
+class NullBuffer : public std::streambuf {
+protected:
+    int overflow(int c) override { return c; }
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; }
+};
+
+// Timings of one benchmarked operation, in nanoseconds
+class BenchStats {
+private:
+    std::string name;
+    std::vector<long long> samples;
+    long long totalNs = 0;
+    std::size_t ops = 0;
+public:
+    explicit BenchStats(std::string n) : name(std::move(n)) {}
 
-        Book bk(i,t,a,p,y,BookStatus::AVAILABLE);
-        books.push_back(bk);
-        std::cout << "Book added.\n";
+    // Times fn() once; `items` is how many records it handled
+    template <typename Fn>
+    void time(Fn &&fn, std::size_t items = 1) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        long long ns = (long long) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        samples.push_back(ns);
+        totalNs += ns;
+        ops += items;
     }
 
-    void removeBook() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::string isbn;
-        std::cout << "Enter ISBN to remove: ";
-        std::getline(std::cin, isbn);
-        for(auto it = books.begin(); it != books.end(); ++it) {
-            if(it->getISBN() == isbn) {
-                if(it->getStatus() == BookStatus::BORROWED) {
-                    std::cout << "Cannot remove a borrowed book.\n";
-                    return;
-                }
-                books.erase(it);
-                std::cout << "Book removed.\n";
-                return;
-            }
+    void report(std::ostream &os) {
+        std::sort(samples.begin(), samples.end());
+        auto pct = [&](double q) {
+            if(samples.empty()) return 0.0;
+            return samples[std::min(samples.size() - 1, (std::size_t) (q * samples.size()))] / 1000.0;
+        };
+        char line[160];
+        double seconds = totalNs / 1e9;
+        std::snprintf(line, sizeof(line), "%-16s %12zu %10.1f %14.0f", name.c_str(), ops,
+                      totalNs / 1e6, seconds > 0 ? ops / seconds : 0.0);
+        os << line;
+        if(samples.size() > 1) {
+            std::snprintf(line, sizeof(line), " %10.2f %10.2f %10.2f %10.2f",
+                          pct(0.50), pct(0.90), pct(0.99), samples.back() / 1000.0);
+            os << line;
         }
-        std::cout << "No such book.\n";
+        os << "\n";
     }
+};
 
-    void updateBook() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::string isbn;
-        std::cout << "Enter ISBN to update: ";
-        std::getline(std::cin, isbn);
-        Book* b = findBook(isbn);
-        if(!b) {
-            std::cout << "No such book.\n";
-            return;
-        }
-        std::string newTitle, newAuthor, newPub;
-        int newYear;
-        std::cout << "Enter new Title (or . to skip): ";
-        std::getline(std::cin, newTitle);
-        if(newTitle != ".") b->setTitle(newTitle);
+// Up to `cap` first fields of the lines in `data` that pass keep(line),
+// evenly spread over the file
+template <typename Keep>
+std::vector<std::string> sampleKeys(std::string_view data, std::size_t cap, Keep &&keep) {
+    std::size_t lines = (std::size_t) std::count(data.begin(), data.end(), '\n');
+    std::size_t every = lines / std::max<std::size_t>(cap, 1) + 1;
+    std::vector<std::string> keys;
+    std::string_view line;
+    for(std::size_t k = 0; nextLine(data, line); ++k) {
+        if(k % every != 0 || line.empty() || !keep(line)) continue;
+        keys.emplace_back(line.substr(0, line.find(',')));
+    }
+    return keys;
+}
 
-        std::cout << "Enter new Author (or . to skip): ";
-        std::getline(std::cin, newAuthor);
-        if(newAuthor != ".") b->setAuthor(newAuthor);
+// Loads the data in `dir` and times the hot paths. Works on copies where
+// it would write (the log, books.txt), so the data stays as it was.
+void runBenchmarks(const std::string &dir, std::size_t ops, std::size_t replayThreads, double skew) {
+    Library lib;
+    std::deque<BenchStats> results; // bench() hands out references, so no vector
+    auto bench = [&](const std::string &name) -> BenchStats& {
+        results.emplace_back(name);
+        return results.back();
+    };
+    MappedFile booksFile(dir + "/books.txt"), usersFile(dir + "/users.txt"), txFile(dir + "/transactions.txt");
+    auto lines = [](const MappedFile &f) {
+        return (std::size_t) std::count(f.view().begin(), f.view().end(), '\n');
+    };
 
-        std::cout << "Enter new Publisher (or . to skip): ";
-        std::getline(std::cin, newPub);
-        if(newPub != ".") b->setPublisher(newPub);
+    bench("loadBooks").time([&] { lib.loadBooks(dir + "/books.txt"); }, lines(booksFile));
+    bench("loadUsers").time([&] { lib.loadUsers(dir + "/users.txt"); }, lines(usersFile));
+    std::size_t txRecords = 0;
+    readTransactionLog(txFile.view(), 0, [&](const TxRecord &) { ++txRecords; });
+    bench("loadTransactions").time([&] { lib.loadTransactions(dir + "/transactions.txt", 0, replayThreads); },
+                                   txRecords);
 
-        std::cout << "Enter new Year (or 0 to skip): ";
-        std::cin >> newYear;
-        if(newYear != 0) b->setYear(newYear);
+    std::vector<std::string> isbns = sampleKeys(booksFile.view(), 1 << 22, [](std::string_view) { return true; });
+    std::vector<std::string> uids = sampleKeys(usersFile.view(), 1 << 20, [](std::string_view line) {
+        return line.find(",Librarian,") == std::string_view::npos;
+    });
+    if(isbns.empty() || uids.empty()) {
+        std::cerr << "No books or patrons in " << dir << "\n";
+        return;
+    }
+    std::mt19937_64 rng(7);
+    SkewedPicker pickBook(isbns.size(), skew);
+    std::uniform_int_distribution<std::size_t> pickUser(0, uids.size() - 1);
 
-        std::cout << "Book updated.\n";
+    BenchStats &find = bench("findBook");
+    for(std::size_t k = 0; k < ops; ++k) {
+        const std::string &isbn = isbns[pickBook(rng)];
+        find.time([&] { lib.findBookShared(isbn); });
     }
 
-    void addUser() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::string uid, pwd, nm, rl;
-        std::cout << "Enter userID: ";
-        std::getline(std::cin, uid);
-        if(findUser(uid)) {
-            std::cout << "User with this ID already exists.\n";
-            return;
-        }
-        std::cout << "Enter password: ";
-        std::getline(std::cin, pwd);
-        std::cout << "Enter name: ";
-        std::getline(std::cin, nm);
-        std::cout << "Enter role (Student/Faculty/Librarian): ";
-        std::getline(std::cin, rl);
+    // borrow + return of a random patron, logged to a scratch log
+    std::string scratchLog = dir + "/bench-transactions.tmp";
+    std::remove(scratchLog.c_str());
+    lib.openTransactionLog(scratchLog);
+    BenchStats &cycle = bench("borrow+return");
+    std::size_t borrowed = 0;
+    for(std::size_t k = 0; k < ops; ++k) {
+        User* u = lib.findUserShared(uids[pickUser(rng)]);
+        const std::string &isbn = isbns[pickBook(rng)];
+        if(!u) continue;
+        cycle.time([&] {
+            if(lib.tryBorrow(*u, isbn).status == OpStatus::OK) {
+                ++borrowed;
+                lib.tryReturn(*u, isbn);
+            }
+        });
+    }
+    lib.closeTransactionLog();
+    std::remove(scratchLog.c_str());
 
-        User* uPtr = nullptr;
-        if(rl == "Student") {
-            uPtr = new Student(uid, pwd, nm);
-        } else if(rl == "Faculty") {
-            uPtr = new Faculty(uid, pwd, nm);
-        } else if(rl == "Librarian") {
-            uPtr = new Librarian(uid, pwd, nm);
+    std::string scratchBooks = dir + "/bench-books.tmp";
+    BenchStats &save = bench("saveBooks");
+    for(int k = 0; k < 3; ++k) save.time([&] { lib.saveBooks(scratchBooks); }, lib.bookCount());
+    std::remove(scratchBooks.c_str());
+
+    NullBuffer sink;
+    std::streambuf *saved = std::cout.rdbuf(&sink);
+    BenchStats &show = bench("showAllBooks");
+    for(int k = 0; k < 3; ++k) show.time([&] { lib.showAllBooks(); }, lib.bookCount());
+    std::cout.rdbuf(saved);
+
+    std::cout << "operation                 items   total ms          per s    p50 us     p90 us     p99 us     max us\n";
+    for(auto &r : results) r.report(std::cout);
+    std::cout << "(" << borrowed << " of " << ops << " borrow attempts found the book available)\n";
+}
+
+int main(int argc, char* argv[]) {
+    // Transaction log durability:
+    //   --log-flush-records N  write the log out every N records (default 1)
+    //   --log-flush-ms T       and at least every T milliseconds
+    //   --log-fsync            fsync every record
+    //   --log-format F         text|binary, used when the log is created
+    //   --replay-threads N     threads for replaying a long log at startup
+    //                          (default: all cores, 1 = serial)
+    // Tools:
+    //   --convert-log IN OUT F rewrite log IN as OUT in format F and exit
+    //   --generate DIR B U T   write B books, U users and T transactions to DIR and exit
+    //   --bench DIR            time the hot paths on the data in DIR and exit
+    //   --bench-ops N          operations per timed hot path (default 100000)
+    //   --skew S               popularity skew for both, 0 = uniform (default 1)
+    //   --hash-passwords       replace plaintext passwords in users.txt with hashes and exit
+    //   --import-books FILE    add the books in FILE (CSV, or TSV if named *.tsv) and exit
+    //   --import-users FILE    add the users in FILE and exit
+    //   --export-books FILE    write all books to FILE and exit
+    //   --export-users FILE    write all users to FILE and exit
+    // Metrics:
+    //   --metrics-file FILE    rewrite FILE with Prometheus text metrics periodically
+    //   --metrics-interval S   seconds between rewrites (default 15)
+    // Lending rules:
+    //   --policy FILE          lending policy file (default policy.txt; built-in
+    //                          rules if it doesn't exist)
+    // Memory:
+    //   --lazy-metadata N      read book titles, authors etc. from the data files
+    //                          on demand, caching the N most recently used
+    // Server mode (instead of the console menu):
+    //   --serve SOCKET         serve requests on a Unix socket
+    //   --workers N            worker threads for --serve (default: all cores)
+    // Batch mode (instead of the console menu):
+    //   --batch FILE           run JSON-lines commands from FILE ('-' = stdin)
+    LogDurability durability;
+    LogFormat logFormat = LogFormat::TEXT;
+    std::string serveSocket;
+    std::string batchFile;
+    std::size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t replayThreads = workers;
+    std::string generateDir, benchDir;
+    std::size_t generateCounts[3] = {0, 0, 0};
+    std::size_t benchOps = 100000;
+    double skew = 1.0;
+    std::string metricsFile;
+    long metricsInterval = 15;
+    std::string policyFile = "policy.txt";
+    bool hashPasswords = false;
+    std::string importBooks, importUsers, exportBooks, exportUsers;
+    std::size_t lazyMetadata = 0;
+    for(int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        if(arg == "--batch" && a + 1 < argc) {
+            batchFile = argv[++a];
+        } else if(arg == "--serve" && a + 1 < argc) {
+            serveSocket = argv[++a];
+        } else if(arg == "--workers" && a + 1 < argc) {
+            workers = std::strtoul(argv[++a], nullptr, 10);
+        } else if(arg == "--replay-threads" && a + 1 < argc) {
+            replayThreads = std::max(1UL, std::strtoul(argv[++a], nullptr, 10));
+        } else if(arg == "--log-format" && a + 1 < argc) {
+            logFormat = (std::string(argv[++a]) == "binary") ? LogFormat::BINARY : LogFormat::TEXT;
+        } else if(arg == "--convert-log" && a + 3 < argc) {
+            LogFormat to = (std::string(argv[a + 3]) == "binary") ? LogFormat::BINARY : LogFormat::TEXT;
+            return convertTransactionLog(argv[a + 1], argv[a + 2], to) ? 0 : 1;
+        } else if(arg == "--generate" && a + 4 < argc) {
+            generateDir = argv[++a];
+            for(auto &n : generateCounts) n = std::strtoull(argv[++a], nullptr, 10);
+        } else if(arg == "--bench" && a + 1 < argc) {
+            benchDir = argv[++a];
+        } else if(arg == "--bench-ops" && a + 1 < argc) {
+            benchOps = std::strtoull(argv[++a], nullptr, 10);
+        } else if(arg == "--metrics-file" && a + 1 < argc) {
+            metricsFile = argv[++a];
+        } else if(arg == "--metrics-interval" && a + 1 < argc) {
+            metricsInterval = std::strtol(argv[++a], nullptr, 10);
+        } else if(arg == "--hash-passwords") {
+            hashPasswords = true;
+        } else if(arg == "--import-books" && a + 1 < argc) {
+            importBooks = argv[++a];
+        } else if(arg == "--import-users" && a + 1 < argc) {
+            importUsers = argv[++a];
+        } else if(arg == "--export-books" && a + 1 < argc) {
+            exportBooks = argv[++a];
+        } else if(arg == "--export-users" && a + 1 < argc) {
+            exportUsers = argv[++a];
+        } else if(arg == "--lazy-metadata" && a + 1 < argc) {
+            lazyMetadata = std::max(1ULL, std::strtoull(argv[++a], nullptr, 10));
+        } else if(arg == "--policy" && a + 1 < argc) {
+            policyFile = argv[++a];
+        } else if(arg == "--skew" && a + 1 < argc) {
+            skew = std::strtod(argv[++a], nullptr);
+        } else if(arg == "--log-flush-records" && a + 1 < argc) {
+            durability.flushEveryRecords = std::strtoul(argv[++a], nullptr, 10);
+        } else if(arg == "--log-flush-ms" && a + 1 < argc) {
+            durability.flushIntervalMs = std::strtol(argv[++a], nullptr, 10);
+        } else if(arg == "--log-fsync") {
+            durability.fsyncEachCommit = true;
         } else {
-            std::cout << "Invalid role.\n";
-            return;
+            std::cerr << "Unknown option: " << arg << "\n";
+            return 1;
         }
-        uPtr->account = new Account();
-        users.push_back(uPtr);
-        std::cout << "User added.\n";
     }
 
-    void removeUser() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::string uid;
-        std::cout << "Enter userID to remove: ";
-        std::getline(std::cin, uid);
-        for(auto it = users.begin(); it != users.end(); ++it) {
-            if((*it)->getUserID() == uid) {
-                if((*it)->account->borrowedCount() > 0) {
-                    std::cout << "Cannot remove user who still borrows a book.\n";
-                    return;
-                }
-                delete (*it)->account;
-                delete (*it);
-                users.erase(it);
-                std::cout << "User removed.\n";
-                return;
-            }
+    // Loan periods decide when replayed loans fall due, so the rules go first
+    if(std::ifstream(policyFile).good()) {
+        std::string error;
+        if(!reloadLendingPolicy(policyFile, error)) {
+            std::cerr << "Lending policy: " << error << "\n";
+            return 1;
         }
-        std::cout << "No such user.\n";
     }
 
-    void showAllBooks() {
-        std::cout << "\n----- All Books -----\n";
-        for(const auto &b : books) {
-            std::cout << "ISBN: " << b.getISBN()
-                      << "\nTitle: " << b.getTitle()
-                      << "\nAuthor: " << b.getAuthor()
-                      << "\nPublisher: " << b.getPublisher()
-                      << "\nYear: " << b.getYear()
-                      << "\nStatus: " << b.getStatusString()
-                      << "\nReservedBy: "
-                      << (b.getReservedBy().empty() ? "None" : b.getReservedBy())
-                      << "\n\n";
-        }
-        std::cout << "---------------------\n";
+    if(!generateDir.empty()) {
+        return generateData(generateDir, generateCounts[0], generateCounts[1], generateCounts[2], skew) ? 0 : 1;
+    }
+    if(!benchDir.empty()) {
+        runBenchmarks(benchDir, benchOps, replayThreads, skew);
+        return 0;
     }
 
-    void showAllUsers() {
-        std::cout << "\n----- All Users -----\n";
-        for(auto *u : users) {
-            std::cout << "UserID: " << u->getUserID()
-                      << ", Name: " << u->getName()
-                      << ", Role: " << u->getRole()
-                      << ", Fine: " << u->getFine()
-                      << "\n";
-        }
-        std::cout << "---------------------\n";
+    std::unique_ptr<MetricsDumper> metricsDumper;
+    if(!metricsFile.empty()) metricsDumper.reset(new MetricsDumper(metricsFile, metricsInterval));
+
+    Library lib;
+    if(lazyMetadata) lib.setLazyMetadata(lazyMetadata);
+    // Load all data once at program start
+    // Resume from the checkpoint and replay only the log written since;
+    // without a usable checkpoint, rebuild everything from the full log.
+    long long logOffset = lib.loadCheckpoint("library.ckpt", "transactions.txt");
+    if(logOffset < 0) {
+        lib.loadBooks("books.txt");
+        lib.loadUsers("users.txt");
+        logOffset = 0;
     }
+    lib.loadChanges("library.delta");
+    lib.loadTransactions("transactions.txt", logOffset, replayThreads);
+    if(!lib.openTransactionLog("transactions.txt", durability, logFormat)) return 1;
 
-    void showUserAccount() {
-        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-        std::string uid;
-        std::cout << "Enter userID: ";
-        std::getline(std::cin, uid);
-        User* u = findUser(uid);
-        if(!u) {
-            std::cout << "No such user.\n";
-            return;
-        }
-        std::cout << "User: " << u->getName() << " ("
-                  << u->getRole() << "), Fine: " << u->getFine() << "\n";
-        auto &cb = u->account->getCurrentBorrows();
-        std::cout << "Currently Borrowed:\n";
-        for(const auto &bi : cb) {
-            std::cout << "  ISBN: " << bi.ISBN 
-                      << ", BorrowedDay: " << bi.borrowDay << "\n";
-        }
-        std::cout << "History:\n";
-        for(const auto &h : u->account->getHistory()) {
-            std::cout << "  ISBN: " << h << "\n";
-        }
+    if(hashPasswords) {
+        std::size_t n = lib.hashPlaintextPasswords(workers);
+        compactLibrary(lib);
+        std::cout << "Hashed " << n << " plaintext passwords.\n";
+        return 0;
     }
 
-    // Save data
-    void saveBooks(const std::string &filename) {
-        std::ofstream fout(filename);
-        if(!fout.is_open()) {
-            std::cerr << "Could not open " << filename << "\n";
-            return;
+    if(!importBooks.empty() || !importUsers.empty() || !exportBooks.empty() || !exportUsers.empty()) {
+        bool ok = true;
+        auto report = [&](const char* what, const std::string &file, const Library::ImportReport &r) {
+            for(const auto &e : r.errors) std::cerr << e << "\n";
+            std::cout << "Imported " << r.added << " " << what << " from " << file << " ("
+                      << r.duplicates << " duplicates, " << r.invalid << " invalid records skipped)\n";
+            ok = ok && r.invalid == 0 && (r.added > 0 || r.duplicates > 0);
+        };
+        if(!importBooks.empty()) report("books", importBooks, lib.importBooks(importBooks, workers));
+        if(!importUsers.empty()) report("users", importUsers, lib.importUsers(importUsers, workers));
+        if(!importBooks.empty() || !importUsers.empty()) compactLibrary(lib);
+        if(!exportBooks.empty()) {
+            std::cout << "Exported " << lib.exportBooks(exportBooks, workers) << " books to " << exportBooks << "\n";
         }
-        for(const auto &b : books) {
-            fout << b.getISBN() << ","
-                 << b.getTitle() << ","
-                 << b.getAuthor() << ","
-                 << b.getPublisher() << ","
-                 << b.getYear() << ","
-                 << b.getStatusString() << "\n";
+        if(!exportUsers.empty()) {
+            std::cout << "Exported " << lib.exportUsers(exportUsers, workers) << " users to " << exportUsers << "\n";
         }
-        fout.close();
+        return ok ? 0 : 2;
     }
 
-    void saveUsers(const std::string &filename) {
-        std::ofstream fout(filename);
-        if(!fout.is_open()) {
-            std::cerr << "Could not open " << filename << "\n";
-            return;
-        }
-        for(auto *u : users) {
-            fout << u->getUserID() << ","
-                 << u->getPassword() << ","
-                 << u->getName() << ","
-                 << u->getRole() << ","
-                 << u->getFine() << "\n";
+    if(!batchFile.empty()) {
+        std::size_t failed;
+        if(batchFile == "-") {
+            std::string input((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+            failed = runBatch(lib, input, std::cout);
+        } else {
+            MappedFile input(batchFile);
+            if(!input.is_open()) {
+                std::cerr << "Could not open " << batchFile << "\n";
+                return 1;
+            }
+            failed = runBatch(lib, input.view(), std::cout);
         }
-        fout.close();
+        compactLibrary(lib);
+        return failed ? 2 : 0;
     }
-};
 
-
-int main() {
-    Library lib;
-    // Load all data once at program start
-    lib.loadBooks("books.txt");
-    lib.loadUsers("users.txt");
-    lib.loadTransactions("transactions.txt");
+    if(!serveSocket.empty()) {
+#ifdef LIBRARY_HAVE_POSIX
+        bool served;
+        {
+            LibraryServer server(lib, workers, policyFile);
+            served = server.run(serveSocket);
+        } // workers finish their requests before we save
+        compactLibrary(lib);
+        return served ? 0 : 1;
+#else
+        std::cerr << "Server mode needs a POSIX system.\n";
+        return 1;
+#endif
+    }
 
     while(true) {
         std::cout << "\n=====================\n"
@@ -781,8 +5734,7 @@ int main() {
         if(choice == 0) {
             // Exit the entire program
             // We could optionally save here if we want the final state
-            lib.saveBooks("books.txt");
-            lib.saveUsers("users.txt");
+            compactLibrary(lib);
             std::cout << "Exiting... Data saved.\n";
             break;
         }
@@ -795,9 +5747,10 @@ int main() {
             std::cin >> pwd;
 
             // Validate
-            User* currentUser = lib.findUser(uid);
-            if(!currentUser || currentUser->getPassword() != pwd) {
-                std::cout << "Invalid credentials.\n";
+            User* currentUser;
+            OpResult login = lib.authenticate(uid, pwd, currentUser);
+            if(!currentUser) {
+                std::cout << login.message;
                 // Return to main menu
                 continue;
             }
@@ -806,14 +5759,17 @@ int main() {
             // We'll allow them to do normal library operations or logout (0).
             while(true) {
                 // If Student or Faculty
-                if(currentUser->getRole() == "Student" || currentUser->getRole() == "Faculty") {
-                    std::cout << "\n---- Menu (" << currentUser->getRole() << ") ----\n"
+                if(currentUser->policy().canBorrow) {
+                    std::cout << "\n---- Menu (" << currentUser->getRoleName() << ") ----\n"
                               << "1. Show all books\n"
                               << "2. Borrow a book\n"
                               << "3. Return a book\n"
                               << "4. View Borrowings\n"
                               << "5. View Transaction History\n"
                               << "6. Pay fines\n"
+                              << "7. Search books\n"
+                              << "8. Browse books (filter, sort, pages)\n"
+                              << "9. My reservations (view/cancel)\n"
                               << "0. Save and Logout\n"
                               << "Choice: ";
                     int ch;
@@ -821,8 +5777,7 @@ int main() {
 
                     if(ch == 0) {
                         // User wants to logout
-                        lib.saveBooks("books.txt");
-                        lib.saveUsers("users.txt");
+                        saveSession(lib);
                         std::cout << "Library data saved. Logging out...\n";
                         break;  // exit this user session, go back to main
                     }
@@ -850,37 +5805,38 @@ int main() {
                             }
                         }
                     } else if(ch==5){
-                        auto &h = currentUser->account->getHistory();
-                        std::cout << "History:\n";
-                        if(h.empty()) {
-                            std::cout << "  No History\n";
-                        } else {
-                            for(const auto &isbn : h) {
-                                std::cout << "  ISBN: " << isbn << "\n";
-                            }
-                        }
+                        lib.showHistory(*currentUser);
                     } else if(ch == 6) {
-                        currentUser->payFine();
+                        lib.payFine(*currentUser);
+                    } else if(ch == 7) {
+                        lib.searchBooks();
+                    } else if(ch == 8) {
+                        lib.browseBooks();
+                    } else if(ch == 9) {
+                        lib.manageReservations(*currentUser);
                     } else {
                         std::cout << "Invalid choice.\n";
                     }
                 }
                 // Librarian menu
-                else if(currentUser->getRole() == "Librarian") {
+                else if(currentUser->getRole() == Role::LIBRARIAN) {
                     std::cout << "\n---- Menu (Librarian) ----\n"
                               << "1. Show all books\n"
                               << "2. Show all users\n"
                               << "3. Show all transactions\n"
                               << "4. Show user account\n"
                               << "5. Manage library (add/remove/update books, add/remove users)\n"
+                              << "6. Search books\n"
+                              << "7. Browse books (filter, sort, pages)\n"
+                              << "8. Show metrics\n"
+                              << "9. Reload lending policy\n"
                               << "0. Save and Logout\n"
                               << "Choice: ";
                     int ch;
                     std::cin >> ch;
 
                     if(ch == 0) {
-                        lib.saveBooks("books.txt");
-                        lib.saveUsers("users.txt");
+                        saveSession(lib);
                         std::cout << "Library data saved. Logging out...\n";
                         break;  // return to main
                     }
@@ -889,31 +5845,22 @@ int main() {
                     } else if(ch == 2) {
                         lib.showAllUsers();
                     } else if(ch == 3) {
-                        // Show all transactions
-                        std::ifstream fin("transactions.txt");
-                        if(!fin.is_open()) {
-                            std::cerr << "Could not open transactions.txt\n";
-                            continue;
-                        }
-                        std::string line;
-                        std::cout << "\n----- All Transactions -----\n";
-                        while(std::getline(fin, line)) {
-                            // get comma seperated elements and use them
-                            std::stringstream ss(line);
-                            std::string uid, isbn, op, dayStr;
-                            std::getline(ss, uid, ',');
-                            std::getline(ss, isbn, ',');
-                            std::getline(ss, op, ',');
-                            std::getline(ss, dayStr, ',');
-                            std::cout << "UserID: " << uid
-                                      << ", ISBN: " << isbn
-                                      << ", Operation: " << op
-                                      << ", DayStamp: " << dayStr << "\n";
-                        }
-                        std::cout << "-----------------------------\n";
-                        fin.close();
+                        lib.showAllTransactions("transactions.txt");
                     } else if(ch == 4) {
                         lib.showUserAccount();
+                    } else if(ch == 6) {
+                        lib.searchBooks();
+                    } else if(ch == 7) {
+                        lib.browseBooks();
+                    } else if(ch == 8) {
+                        lib.showMetrics();
+                    } else if(ch == 9) {
+                        std::string error;
+                        if(reloadLendingPolicy(policyFile, error)) {
+                            std::cout << "Lending policy reloaded from " << policyFile << ".\n";
+                        } else {
+                            std::cout << "Lending policy not changed: " << error << "\n";
+                        }
                     } else if(ch == 5) {
                         // sub-menu for library management
                         while(true) {
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Fields the data files can't hold (commas, line breaks) are refused with
+# INVALID, and accepted records come back intact after a restart.
+#   usage: tests/batch_field_validation.sh   (from the repository root)
+set -e
+root=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+g++ -std=c++17 -O2 -pthread -o "$dir/library" "$root/main.cpp"
+cp "$root/books.txt" "$root/users.txt" "$root/transactions.txt" "$root/policy.txt" "$dir/"
+cd "$dir"
+
+cat > add.jsonl <<'JSON'
+{"op":"add_book","isbn":"9991","title":"New, Title","author":"A","publisher":"P","year":"2001"}
+{"op":"add_book","isbn":"9992","title":"Two\nLines","author":"A","publisher":"P","year":"2001"}
+{"op":"add_book","isbn":"9993","title":"Fine Title","author":"A","publisher":"P","year":"2001"}
+{"op":"update_book","isbn":"9993","author":"Doe, Jane"}
+{"op":"add_user","user":"x01","password":"pw","name":"Doe, John","role":"Student"}
+{"op":"add_user","user":"x02","password":"a,b","name":"John Doe","role":"Student"}
+JSON
+./library --batch add.jsonl >out1.txt 2>/dev/null || true
+expect() { grep -q "$1" "$2" || { echo "FAIL: expected $1 in $2"; cat "$2"; exit 1; }; }
+expect '"line":1,"op":"add_book","status":"INVALID"' out1.txt
+expect '"line":2,"op":"add_book","status":"INVALID"' out1.txt
+expect '"line":3,"op":"add_book","status":"OK"' out1.txt
+expect '"line":4,"op":"update_book","status":"INVALID"' out1.txt
+expect '"line":5,"op":"add_user","status":"INVALID"' out1.txt
+expect '"line":6,"op":"add_user","status":"OK"' out1.txt
+
+# restart: the accepted records load back unchanged, the refused ones don't exist
+cat > find.jsonl <<'JSON'
+{"op":"find_book","isbn":"9993"}
+{"op":"find_book","isbn":"9991"}
+{"op":"find_book","isbn":"9992"}
+JSON
+./library --batch find.jsonl >out2.txt 2>/dev/null || true
+expect '"line":1,"op":"find_book","status":"OK","message":"","data":"9993,Fine Title,A,P,2001,Available,"' out2.txt
+expect '"line":2,"op":"find_book","status":"NOT_FOUND"' out2.txt
+expect '"line":3,"op":"find_book","status":"NOT_FOUND"' out2.txt
+grep -q '^x02,\$scrypt\$' users.txt library.ckpt library.delta 2>/dev/null || { echo "FAIL: x02 not stored"; exit 1; }
+echo "PASS"
@@ -0,0 +1,26 @@
+#!/bin/sh
+# A plaintext password rehashed at login must survive a restart:
+# login -> killed before any compaction -> restart -> compact -> users.txt
+# holds the scrypt hash, and the password still works against it.
+#   usage: tests/login_rehash.sh   (from the repository root)
+set -e
+root=$(pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+g++ -std=c++17 -O2 -pthread -o "$dir/library" "$root/main.cpp"
+cp "$root/books.txt" "$root/users.txt" "$root/transactions.txt" "$root/policy.txt" "$dir/"
+cd "$dir"
+
+# log in and out (journals the rehash), then die without exiting cleanly
+printf '1\ns04\npwd4\n0\n' | timeout 5 ./library >/dev/null 2>&1 || true
+grep -q '^+U,s04,\$scrypt\$' library.delta || { echo "FAIL: rehash not journaled"; exit 1; }
+
+# restart and exit without logging in (compacts)
+printf '0\n' | ./library >/dev/null 2>&1
+grep -q '^s04,\$scrypt\$' users.txt || { echo "FAIL: users.txt lost the hash"; exit 1; }
+grep -q '^U,s04,\$scrypt\$' library.ckpt || { echo "FAIL: checkpoint lost the hash"; exit 1; }
+
+# the stored hash still accepts the password
+printf '1\ns04\npwd4\n0\n0\n' | ./library >out.txt 2>&1
+grep -q 'Save and Logout' out.txt || { echo "FAIL: login after restart"; exit 1; }
+echo "PASS"